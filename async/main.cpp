@@ -3,26 +3,41 @@
  * - We start with a single thread io operations processing
  *
  */
+#include "common/append_log.hpp"
+#include "common/batch.hpp"
+#include "common/cancellation.hpp"
 #include "common/helpers.hpp"
+#include "common/metrics.hpp"
+#include "common/oplog.hpp"
+#include "common/topology.hpp"
 #include "threadpool.hpp"
 
 #include <fcntl.h>
 #include <filesystem>
 #include <future>
+#include <optional>
 #include <print>
 #include <string>
 #include <string_view>
 #include <unistd.h>
-#include <unordered_set>
 #include <variant>
 #include <vector>
 
 namespace fs = std::filesystem;
 
-std::future<size_t> countNumbersInFileAsync(const fs::path& path, ThreadPool& threadPool)
+// The count is std::nullopt if `token` is cancelled before the file is opened,
+// or while the scan is queued or running. The fd is closed either way.
+std::future<std::optional<size_t>> countNumbersInFileAsync(const fs::path& path,
+                                                           ThreadPool& threadPool,
+                                                           const CancellationToken& token)
 {
-    std::promise<size_t> promise;
-    std::future<size_t> future = promise.get_future();
+    std::promise<std::optional<size_t>> promise;
+    std::future<std::optional<size_t>> future = promise.get_future();
+    if (token.cancelled())
+    {
+        promise.set_value(std::nullopt);
+        return future;
+    }
     if (!fs::exists(path))
     {
         promise.set_value(0);
@@ -30,19 +45,31 @@ std::future<size_t> countNumbersInFileAsync(const fs::path& path, ThreadPool& th
     }
 
     const auto fd = open(path.c_str(), O_RDONLY);
+    metrics::io().openCalls.add();
     if (fd == -1)
     {
         promise.set_value(0);
         return future;
     }
+    metrics::io().opsInFlight.add(1);
     threadPool.enqueue(
-        [fd, prom = std::move(promise)]() mutable
+        [fd, token, prom = std::move(promise)]() mutable
         {
+            if (token.cancelled())
+            {
+                metrics::io().opsInFlight.add(-1);
+                prom.set_value(std::nullopt);
+                return;
+            }
+            evictFromPageCacheIfCold(fd);
             size_t count = 0;
+            size_t totalRead = 0;
             char buffer[4096];
             ssize_t bytesRead;
-            while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+            bool cancelled = false;
+            while (!(cancelled = token.cancelled()) && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
             {
+                totalRead += static_cast<size_t>(bytesRead);
                 for (ssize_t i = 0; i < bytesRead; ++i)
                 {
                     if (buffer[i] >= '0' && buffer[i] <= '9')
@@ -51,13 +78,16 @@ std::future<size_t> countNumbersInFileAsync(const fs::path& path, ThreadPool& th
                     }
                 }
             }
-            prom.set_value(count);
+            metrics::io().bytesRead.add(totalRead);
+            metrics::io().opsInFlight.add(-1);
+            prom.set_value(cancelled ? std::nullopt : std::optional<size_t>{count});
         });
 
     return std::async(std::launch::deferred,
-                      [fd, future = std::move(future)]() mutable -> size_t
+                      [fd, future = std::move(future)]() mutable -> std::optional<size_t>
                       {
                           future.wait();
+                          metrics::io().closeCalls.add();
                           if (close(fd) == -1)
                           {
                               return 0;
@@ -66,178 +96,142 @@ std::future<size_t> countNumbersInFileAsync(const fs::path& path, ThreadPool& th
                       });
 }
 
-std::future<bool> readFileHasValidNumberOfDigitsAsync(const fs::path& path, ThreadPool& threadPool)
+std::future<Outcome> readFileHasValidNumberOfDigitsAsync(const fs::path& path,
+                                                        ThreadPool& threadPool,
+                                                        const CancellationToken& token)
 {
-    std::future<size_t> countFut = countNumbersInFileAsync(path, threadPool);
+    std::future<std::optional<size_t>> countFut = countNumbersInFileAsync(path, threadPool, token);
     return std::async(std::launch::deferred,
                       [cf = std::move(countFut)]() mutable
                       {
-                          size_t count = cf.get();
-                          return count % 10 == 0;
+                          std::optional<size_t> count = cf.get();
+                          if (!count)
+                          {
+                              return Outcome::Cancelled;
+                          }
+                          return outcomeOf(*count % 10 == 0);
                       });
 }
 
-bool writeToFile(const fs::path& path,
-                 std::string_view data,
-                 std::optional<off_t> offset = std::nullopt)
+std::future<Outcome> processOperation(const ReadOperation& readOp,
+                                     ThreadPool& threadPool,
+                                     const CancellationToken& token)
 {
-    // Open the file using linux api
-    const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_APPEND), 0644);
-    if (fd == -1)
-    {
-        std::println("write: open failed");
-        return false;
-    }
-    if (offset)
-    {
-        if (::lseek(fd, *offset, SEEK_SET) == (off_t)-1)
-        {
-            ::close(fd);
-            std::println("write: lseek failed");
-            return false;
-        }
-    }
-    ssize_t bytesWritten = write(fd, data.data(), data.size());
-    if (bytesWritten == -1)
-    {
-        std::println("write: write failed");
-        close(fd);
-        return false;
-    }
-    close(fd);
-    return bytesWritten == static_cast<ssize_t>(data.size());
-}
-
-bool writeToFileInChunks(const fs::path& path, std::string_view data, size_t nChunks)
-{
-    size_t totalSize = data.size();
-    size_t offset = 0;
-    size_t chunkSize = totalSize / nChunks;
-    while (offset < totalSize)
-    {
-        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
-        if (!writeToFile(path, data.substr(offset, currentChunkSize), offset))
-        {
-            std::println("writeToFileInChunks: writeToFile failed at offset {}", offset);
-            return false;
-        }
-        offset += currentChunkSize;
-    }
-    return true;
-}
-
-using ResultType = std::variant<bool, std::future<bool>>;
-
-ResultType processOperation(const Operation& op, ThreadPool& threadPool)
-{
-    return std::visit(
-        overloaded{[&threadPool](const ReadOperation& readOp) -> ResultType
-                   {
-                       return readFileHasValidNumberOfDigitsAsync(readOp.path, threadPool);
-                   },
-                   [](const WriteOperation& writeOp) -> ResultType
-                   {
-                       return writeToFile(writeOp.path, writeOp.data);
-                   },
-                   [](const WriteInChunksOperation& writeOp) -> ResultType
-                   {
-                       return writeToFileInChunks(writeOp.path, writeOp.data, writeOp.chunkSize);
-                   }},
-        op);
+    return readFileHasValidNumberOfDigitsAsync(readOp.path, threadPool, token);
 }
 
 class Component
 {
 public:
 
-    Component()
+    // A stop requested on `stopSource` has the same effect as `requestStop`.
+    Component(oplog::Session& session, std::stop_source stopSource)
+        : mSession(session), mStopSource(std::move(stopSource))
     {
-        mOperations.reserve(NUM_OPERATIONS);
-        for (size_t i = 0; i < NUM_OPERATIONS; ++i)
-        {
-            mOperations.push_back(createRandomOperation(mBuffer));
-        }
+        mSession.attachBuffer(mBuffer.view());
+        std::apply(
+            [](auto&... bucket)
+            {
+                (bucket.reserve(NUM_OPERATIONS), ...);
+            },
+            mOperations);
+        refillOperationsIfNeeded();
     }
 
     void eventLoop(size_t iterations)
     {
-        for (size_t i = 0; i < iterations; ++i)
+        for (size_t i = 0; i < iterations && !mStopSource.stop_requested() && mSession.beginIteration(mOperations);
+             ++i)
         {
-            runIteration();
+            runIteration(i);
+            mSession.endIteration();
             refillOperationsIfNeeded();
+            mThreadPool.resize(mPoolSizer.update());
+            mMetricsDumper.tick();
         }
+        // Closed before the final dump so it counts every close.
+        mAppendLog.close();
+        mMetricsDumper.dump();
+    }
+
+    // Can be called from any thread. Operations in flight are cancelled and the
+    // event loop returns after the current iteration.
+    void requestStop()
+    {
+        mStopSource.request_stop();
     }
 
     void refillOperationsIfNeeded()
     {
-        while (mOperations.size() < NUM_OPERATIONS)
+        for (size_t i = operationCount(mOperations); i < NUM_OPERATIONS; ++i)
         {
-            mOperations.push_back(createRandomOperation(mBuffer));
+            addOperation(mOperations, createRandomOperation(mBuffer.view()));
         }
     }
 
-    void runIteration()
+    void runIteration(size_t iteration)
     {
-        std::vector<ResultType> results;
-        results.reserve(mOperations.size());
-        for (size_t i = 0; i < mOperations.size(); ++i)
+        // Hand every read to the pool first so they overlap with the writes,
+        // which run on this thread.
+        const CancellationToken token = iterationToken(mStopSource, mIterationBudget);
+        auto& reads = std::get<std::vector<ReadOperation>>(mOperations);
+        std::vector<std::future<Outcome>> pendingReads;
+        pendingReads.reserve(reads.size());
+        for (const ReadOperation& readOp: reads)
         {
-            results.push_back(processOperation(mOperations[i], mThreadPool));
+            pendingReads.push_back(processOperation(readOp, mThreadPool, token));
         }
-        std::unordered_set<size_t> indicesToErase;
-        indicesToErase.reserve(mOperations.size());
-        for (size_t i = 0; i < results.size(); ++i)
+
+        processWriteBuckets(mOperations, iteration, mSession, mAppendLog, token);
+
+        std::vector<Outcome> outcomes(reads.size());
+        for (size_t i = 0; i < pendingReads.size(); ++i)
         {
-            std::visit(overloaded{[&indicesToErase, i](bool remove)
-                                  {
-                                      if (remove)
-                                      {
-                                          indicesToErase.insert(i);
-                                      }
-                                  },
-                                  [&indicesToErase, i](std::future<bool> removeFut)
-                                  {
-                                      if (removeFut.get())
-                                      {
-                                          indicesToErase.insert(i);
-                                      }
-                                  }},
-                       std::move(results[i]));
+            outcomes[i] = pendingReads[i].get();
         }
-        size_t i = 0;
-        mOperations.erase(std::remove_if(mOperations.begin(),
-                                         mOperations.end(),
-                                         [&indicesToErase, &i](const Operation&)
-                                         {
-                                             return indicesToErase.contains(i++);
-                                         }),
-                          mOperations.end());
+        completeBatch(mSession, reads, outcomes);
     }
 
 private:
-    std::vector<Operation> mOperations;
-    const std::string mBuffer = generateRandomString(5 * 1024 * 1024);
-
-    ThreadPool mThreadPool{NUM_THREADS};
+    oplog::Session& mSession;
+    std::stop_source mStopSource;
+    const std::optional<std::chrono::milliseconds> mIterationBudget = iterationBudgetFromEnvironment();
+    OperationBuckets mOperations;
+    AppendLog mAppendLog;
+    const topology::NodeLocalBuffer mBuffer =
+        generateRandomBuffer(5 * 1024 * 1024, topology::affinityConfig().memoryNode);
+
+    PoolSizer mPoolSizer{{.minThreads = MIN_THREADS, .maxThreads = MAX_THREADS}, NUM_THREADS};
+    ThreadPool mThreadPool{mPoolSizer.size(), topology::pinWorker};
+    metrics::PeriodicDumper mMetricsDumper{"metrics_async.prom", metrics::DUMP_INTERVAL};
 };
 
 int main()
 {
-    Component component{};
+    // Before any thread exists, so none of them gets SIGINT or SIGTERM.
+    ShutdownSignals shutdownSignals;
+    if (!topology::pinCurrentThread(topology::affinityConfig().owner))
+    {
+        std::println("main: failed to pin the owner thread");
+    }
+    oplog::Session session = oplog::Session::fromEnvironment();
+    srand(static_cast<unsigned>(session.seed()));
+    // Every run starts from the same files so replays see the same contents.
+    removeDataFiles();
+    Component component{session, shutdownSignals.stopSource()};
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     component.eventLoop(NUM_ITERATIONS);
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     std::println("Async - Execution time: {} ms", duration);
 
-    // remove files
-    for (size_t i = 0; i < MAX_FILE_INDEX; ++i)
+    if (session.replaying())
     {
-        fs::path path = fs::path("file_" + std::to_string(i) + ".txt");
-        if (fs::exists(path))
-        {
-            fs::remove(path);
-        }
+        std::println("{} - Replay: {} outcomes differ from the log", "Async", session.mismatches());
     }
-    return 0;
+
+    removeDataFiles();
+    // A replay that diverged from its log, or a log that could not be written
+    // or read in full, fails the run.
+    return session.mismatches() == 0 && !session.logFailed() ? 0 : 1;
 }
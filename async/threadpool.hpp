@@ -1,8 +1,14 @@
 #pragma once
 
+#include "common/metrics.hpp"
+#include "common/pool_sizer.hpp"
+
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <functional>
+#include <list>
 #include <mutex>
 #include <queue>
 #include <thread>
@@ -13,34 +19,12 @@ class ThreadPool
 public:
     using Task = std::move_only_function<void()>;
 
-    ThreadPool(size_t numThreads)
+    // `onThreadStart` runs first thing on every worker with its index, e.g. to
+    // set its CPU affinity.
+    ThreadPool(size_t numThreads, std::function<void(size_t)> onThreadStart = nullptr)
+        : mOnThreadStart(std::move(onThreadStart))
     {
-        for (size_t i = 0; i < numThreads; ++i)
-        {
-            mThreads.emplace_back(
-                [this]()
-                {
-                    while (true)
-                    {
-                        Task task;
-                        {
-                            std::unique_lock<std::mutex> lock(mMutex);
-                            mCondition.wait(lock,
-                                            [this]()
-                                            {
-                                                return mStop || !mTasks.empty();
-                                            });
-                            if (mStop && mTasks.empty())
-                            {
-                                return;
-                            }
-                            task = std::move(mTasks.front());
-                            mTasks.pop();
-                        }
-                        task();
-                    }
-                });
-        }
+        resize(numThreads);
     }
 
     ~ThreadPool()
@@ -50,26 +34,130 @@ public:
             mStop = true;
         }
         mCondition.notify_all();
-        for (std::thread& thread: mThreads)
+        for (Worker& worker: mWorkers)
         {
-            thread.join();
+            worker.thread.join();
         }
     }
 
+    // Spawns or retires workers until `numThreads` are active. Retired workers
+    // finish the task they are running first and are joined on a later call.
+    void resize(size_t numThreads)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto it = mWorkers.begin(); it != mWorkers.end();)
+        {
+            if (it->finished)
+            {
+                it->thread.join();
+                it = mWorkers.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        for (; mActiveThreads < numThreads; ++mActiveThreads)
+        {
+            const size_t index = lowestFreeIndex();
+            Worker& worker = mWorkers.emplace_back();
+            worker.index = index;
+            worker.thread = std::thread(
+                [this, &worker, index]()
+                {
+                    workerLoop(worker, index);
+                });
+        }
+        if (mActiveThreads > numThreads)
+        {
+            mRetiring += mActiveThreads - numThreads;
+            mActiveThreads = numThreads;
+            mCondition.notify_all();
+        }
+    }
 
     void enqueue(Task&& task)
     {
         {
             std::lock_guard<std::mutex> lock(mMutex);
-            mTasks.push(std::move(task));
+            mTasks.push({std::move(task), std::chrono::steady_clock::now()});
+            metrics::io().poolQueueDepth.set(static_cast<int64_t>(mTasks.size()));
         }
         mCondition.notify_one();
     }
 
 private:
-    std::vector<std::thread> mThreads;
+    struct QueuedTask
+    {
+        Task task;
+        std::chrono::steady_clock::time_point enqueuedAt;
+    };
+
+    struct Worker
+    {
+        std::thread thread;
+        size_t index = 0;
+        bool finished = false;
+    };
+
+    // Lowest index no running worker holds. Reusing the indices of retired
+    // workers keeps `onThreadStart` placement one worker per index across
+    // shrinks and grows. Called with `mMutex` held.
+    size_t lowestFreeIndex() const
+    {
+        std::vector<bool> used(mWorkers.size() + 1);
+        for (const Worker& worker: mWorkers)
+        {
+            if (!worker.finished && worker.index < used.size())
+            {
+                used[worker.index] = true;
+            }
+        }
+        return static_cast<size_t>(std::ranges::find(used, false) - used.begin());
+    }
+
+    void workerLoop(Worker& worker, size_t index)
+    {
+        if (mOnThreadStart)
+        {
+            mOnThreadStart(index);
+        }
+        while (true)
+        {
+            QueuedTask queued;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock,
+                                [this]()
+                                {
+                                    return mStop || mRetiring > 0 || !mTasks.empty();
+                                });
+                if (mRetiring > 0)
+                {
+                    --mRetiring;
+                    worker.finished = true;
+                    return;
+                }
+                if (mStop && mTasks.empty())
+                {
+                    return;
+                }
+                queued = std::move(mTasks.front());
+                mTasks.pop();
+                metrics::io().poolQueueDepth.set(static_cast<int64_t>(mTasks.size()));
+            }
+            metrics::io().poolTaskWaitNs.record(std::chrono::steady_clock::now() - queued.enqueuedAt);
+            ScopedWorkTimer timer;
+            queued.task();
+        }
+    }
+
+    std::function<void(size_t)> mOnThreadStart;
+    std::list<Worker> mWorkers;
+    size_t mActiveThreads = 0;
+    size_t mRetiring = 0;
 
-    std::queue<Task> mTasks;
+    std::queue<QueuedTask> mTasks;
     std::mutex mMutex;
     std::condition_variable mCondition;
     bool mStop = false;
@@ -0,0 +1,216 @@
+/*
+ * Append contention benchmark:
+ * - Many writer threads append fixed size records to the same few data files:
+ *   - opening the file with O_APPEND, writing and closing it for every record
+ *     (the engines' original write path)
+ *   - writing to one O_APPEND descriptor per file opened up front, which
+ *     leaves only the contention on the file offset and inode lock
+ *   - through AppendLog, which reserves a range per record and pwrites into it
+ * - The second against the third isolates the effect of the reservation from
+ *   that of not reopening the file.
+ * - Checks every file ends up with exactly the bytes appended to it.
+ * - Runs in the working directory and removes the data files when done.
+ *
+ */
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <latch>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "common/append_log.hpp"
+#include "common/helpers.hpp"
+
+namespace
+{
+
+constexpr size_t NUM_FILES = 4;
+constexpr size_t RECORD_SIZE = 1024;
+// Split among the writers, so every run moves the same amount of data.
+constexpr size_t TOTAL_RECORDS = 64 * 1024;
+constexpr std::array<size_t, 3> WRITERS_PER_FILE = {1, 4, 16};
+
+bool openAppendClose(const fs::path& path, std::string_view data)
+{
+    const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1)
+    {
+        return false;
+    }
+    const ssize_t bytesWritten = write(fd, data.data(), data.size());
+    close(fd);
+    return bytesWritten == static_cast<ssize_t>(data.size());
+}
+
+// Every file opened once with O_APPEND and shared by all its writers.
+class SharedAppendFiles
+{
+public:
+    SharedAppendFiles()
+    {
+        for (size_t i = 0; i < NUM_FILES; ++i)
+        {
+            mFds[i] = open(dataFilePath(i).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        }
+    }
+
+    ~SharedAppendFiles()
+    {
+        for (int fd: mFds)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    SharedAppendFiles(const SharedAppendFiles&) = delete;
+    SharedAppendFiles& operator=(const SharedAppendFiles&) = delete;
+
+    bool append(const fs::path& path, std::string_view data) const
+    {
+        const std::optional<size_t> index = dataFileIndex(path);
+        if (!index || *index >= NUM_FILES)
+        {
+            return false;
+        }
+        const int fd = mFds[*index];
+        return fd != -1 && write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    }
+
+private:
+    std::array<int, NUM_FILES> mFds;
+};
+
+struct Result
+{
+    double mibPerSecond = 0.0;
+    double microsecondsPerRecord = 0.0;
+    bool consistent = true;
+};
+
+// The data files must be empty or missing when it starts.
+template<class Append>
+Result run(size_t writersPerFile, std::string_view record, Append&& append)
+{
+    const size_t numWriters = writersPerFile * NUM_FILES;
+    const size_t recordsPerWriter = TOTAL_RECORDS / numWriters;
+
+    std::latch start(static_cast<std::ptrdiff_t>(numWriters + 1));
+    std::atomic<size_t> failures{0};
+    std::vector<std::thread> writers;
+    writers.reserve(numWriters);
+    for (size_t w = 0; w < numWriters; ++w)
+    {
+        writers.emplace_back(
+            [&, w]()
+            {
+                const fs::path path = dataFilePath(w % NUM_FILES);
+                start.arrive_and_wait();
+                for (size_t r = 0; r < recordsPerWriter; ++r)
+                {
+                    if (!append(path, record))
+                    {
+                        failures.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            });
+    }
+    start.arrive_and_wait();
+    const auto begin = std::chrono::steady_clock::now();
+    for (std::thread& writer: writers)
+    {
+        writer.join();
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    Result result;
+    const size_t records = recordsPerWriter * numWriters;
+    const double seconds = std::chrono::duration<double>(end - begin).count();
+    result.mibPerSecond = static_cast<double>(records * record.size()) / (1024.0 * 1024.0) / seconds;
+    result.microsecondsPerRecord = seconds * 1e6 / static_cast<double>(records);
+
+    const uintmax_t expectedSize = writersPerFile * recordsPerWriter * record.size();
+    for (size_t i = 0; i < NUM_FILES; ++i)
+    {
+        std::error_code ec;
+        const uintmax_t size = fs::file_size(dataFilePath(i), ec);
+        if (ec || size != expectedSize)
+        {
+            std::println("  {}: {} bytes, expected {}", dataFilePath(i).string(), ec ? 0 : size, expectedSize);
+            result.consistent = false;
+        }
+    }
+    if (failures.load() != 0)
+    {
+        std::println("  {} appends failed", failures.load());
+        result.consistent = false;
+    }
+    return result;
+}
+
+void printResult(std::string_view name, const Result& result)
+{
+    std::println("  {:<18} {:9.1f} MiB/s {:8.2f} us/record{}",
+                 name,
+                 result.mibPerSecond,
+                 result.microsecondsPerRecord,
+                 result.consistent ? "" : "  INCONSISTENT");
+}
+
+void runFor(size_t writersPerFile, std::string_view record)
+{
+    removeDataFiles();
+    const Result reopened = run(writersPerFile, record, openAppendClose);
+
+    removeDataFiles();
+    Result shared;
+    {
+        const SharedAppendFiles files;
+        shared = run(writersPerFile,
+                     record,
+                     [&files](const fs::path& path, std::string_view data)
+                     {
+                         return files.append(path, data);
+                     });
+    }
+
+    removeDataFiles();
+    Result reserved;
+    {
+        AppendLog appendLog;
+        reserved = run(writersPerFile,
+                       record,
+                       [&appendLog](const fs::path& path, std::string_view data)
+                       {
+                           return appendLog.append(path, data);
+                       });
+    }
+
+    std::println("{} files, {} writers per file, {} B records:", NUM_FILES, writersPerFile, record.size());
+    printResult("open/append/close", reopened);
+    printResult("shared O_APPEND fd", shared);
+    printResult("reserve + pwrite", reserved);
+}
+
+} // namespace
+
+int main()
+{
+    const std::string record = generateRandomString(RECORD_SIZE);
+    for (size_t writersPerFile: WRITERS_PER_FILE)
+    {
+        runFor(writersPerFile, record);
+    }
+    removeDataFiles();
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Dispatch micro-benchmark:
+ * - Compares std::visit per operation against bucketed, kind-specialized batch
+ *   handlers, both for plain functions and for libcoro tasks.
+ * - The handlers do no IO so only dispatch and coroutine frame costs are left.
+ * - Every repetition pays what an engine pays per iteration around dispatch:
+ *   the flat queue is copied and compacted after the removals; the bucketed
+ *   one has every operation sorted into buckets with addOperation and is then
+ *   requeued with requeueBatch. Engines only bucket the refilled operations,
+ *   so bucketing the whole queue overstates that cost.
+ *
+ */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wshorten-64-to-32"
+#pragma clang diagnostic ignored "-Wimplicit-int-conversion"
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#include <coro/coro.hpp>
+#pragma clang diagnostic pop
+
+#include <chrono>
+#include <print>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "common/helpers.hpp"
+
+namespace
+{
+
+constexpr size_t NUM_REPETITIONS = 20;
+
+// Stand-ins for the real IO. Kept out of line so the compiler cannot fold the
+// dispatch away.
+[[gnu::noinline]] bool fakeRead(const ReadOperation& op)
+{
+    return op.path.native().size() % 2 == 0;
+}
+
+[[gnu::noinline]] bool fakeWrite(const WriteOperation& op)
+{
+    return op.data.size() % 2 == 0;
+}
+
+[[gnu::noinline]] bool fakeWriteInChunks(const WriteInChunksOperation& op)
+{
+    return op.chunkSize % 2 == 0;
+}
+
+bool fakeProcess(const ReadOperation& op)
+{
+    return fakeRead(op);
+}
+
+bool fakeProcess(const WriteOperation& op)
+{
+    return fakeWrite(op);
+}
+
+bool fakeProcess(const WriteInChunksOperation& op)
+{
+    return fakeWriteInChunks(op);
+}
+
+// Erases the operations flagged in `remove`, as the flat queue engines did.
+size_t eraseFlagged(std::vector<Operation>& ops, const std::vector<char>& remove)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        if (!remove[i])
+        {
+            ops[kept++] = std::move(ops[i]);
+        }
+    }
+    const size_t removed = ops.size() - kept;
+    ops.resize(kept);
+    return removed;
+}
+
+OperationBuckets bucketize(const std::vector<Operation>& ops)
+{
+    OperationBuckets buckets;
+    for (const Operation& op: ops)
+    {
+        addOperation(buckets, Operation{op});
+    }
+    return buckets;
+}
+
+size_t visitEach(std::vector<Operation> ops)
+{
+    std::vector<char> remove(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        remove[i] = std::visit(overloaded{[](const ReadOperation& readOp)
+                                         {
+                                             return fakeRead(readOp);
+                                         },
+                                         [](const WriteOperation& writeOp)
+                                         {
+                                             return fakeWrite(writeOp);
+                                         },
+                                         [](const WriteInChunksOperation& writeOp)
+                                         {
+                                             return fakeWriteInChunks(writeOp);
+                                         }},
+                              ops[i]);
+    }
+    return eraseFlagged(ops, remove);
+}
+
+template<class Op>
+size_t processBucket(std::vector<Op>& ops)
+{
+    std::vector<Outcome> outcomes(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        outcomes[i] = outcomeOf(fakeProcess(ops[i]));
+    }
+    return requeueBatch(ops, outcomes);
+}
+
+size_t processBuckets(const std::vector<Operation>& ops)
+{
+    OperationBuckets buckets = bucketize(ops);
+    return std::apply(
+        [](auto&... bucket)
+        {
+            return (processBucket(bucket) + ...);
+        },
+        buckets);
+}
+
+// Mirrors the old coro engine: every arm is a coroutine wrapped in another one.
+coro::task<bool> fakeReadTask(const ReadOperation& op)
+{
+    co_return fakeRead(op);
+}
+
+coro::task<bool> visitEachTask(const Operation& op)
+{
+    co_return co_await std::visit(overloaded{[](const ReadOperation& readOp) -> coro::task<bool>
+                                             {
+                                                 co_return co_await fakeReadTask(readOp);
+                                             },
+                                             [](const WriteOperation& writeOp) -> coro::task<bool>
+                                             {
+                                                 co_return fakeWrite(writeOp);
+                                             },
+                                             [](const WriteInChunksOperation& writeOp) -> coro::task<bool>
+                                             {
+                                                 co_return fakeWriteInChunks(writeOp);
+                                             }},
+                                  op);
+}
+
+size_t visitEachCoro(std::vector<Operation> ops)
+{
+    std::vector<coro::task<bool>> tasks;
+    tasks.reserve(ops.size());
+    for (const Operation& op: ops)
+    {
+        tasks.push_back(visitEachTask(op));
+    }
+    auto results = coro::sync_wait(coro::when_all(std::move(tasks)));
+    std::vector<char> remove(ops.size());
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        remove[i] = results[i].return_value();
+    }
+    return eraseFlagged(ops, remove);
+}
+
+// Mirrors the new coro engine: only reads get a frame, writes run in one.
+coro::task<bool> processWriteBucketsTask(OperationBuckets& buckets, size_t& removed)
+{
+    removed += processBucket(std::get<std::vector<WriteOperation>>(buckets));
+    removed += processBucket(std::get<std::vector<WriteInChunksOperation>>(buckets));
+    co_return true;
+}
+
+size_t processBucketsCoro(const std::vector<Operation>& ops)
+{
+    OperationBuckets buckets = bucketize(ops);
+    auto& reads = std::get<std::vector<ReadOperation>>(buckets);
+    std::vector<coro::task<bool>> tasks;
+    tasks.reserve(reads.size() + 1);
+    for (const ReadOperation& readOp: reads)
+    {
+        tasks.push_back(fakeReadTask(readOp));
+    }
+    size_t removed = 0;
+    tasks.push_back(processWriteBucketsTask(buckets, removed));
+    auto results = coro::sync_wait(coro::when_all(std::move(tasks)));
+    std::vector<Outcome> outcomes(reads.size());
+    for (size_t i = 0; i < reads.size(); ++i)
+    {
+        outcomes[i] = outcomeOf(results[i].return_value());
+    }
+    return removed + requeueBatch(reads, outcomes);
+}
+
+template<class Fn>
+double nanosecondsPerOperation(size_t numOperations, Fn&& fn)
+{
+    size_t sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < NUM_REPETITIONS; ++i)
+    {
+        sink += fn();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    if (sink == static_cast<size_t>(-1))
+    {
+        std::println("unreachable");
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    return static_cast<double>(elapsed) / static_cast<double>(numOperations * NUM_REPETITIONS);
+}
+
+void runFor(size_t numOperations, const std::string& buffer)
+{
+    std::vector<Operation> ops;
+    ops.reserve(numOperations);
+    for (size_t i = 0; i < numOperations; ++i)
+    {
+        ops.push_back(createRandomOperation(buffer));
+    }
+
+    const double visit = nanosecondsPerOperation(numOperations,
+                                                 [&ops]()
+                                                 {
+                                                     return visitEach(ops);
+                                                 });
+    const double bucketed = nanosecondsPerOperation(numOperations,
+                                                    [&ops]()
+                                                    {
+                                                        return processBuckets(ops);
+                                                    });
+    const double visitCoro = nanosecondsPerOperation(numOperations,
+                                                     [&ops]()
+                                                     {
+                                                         return visitEachCoro(ops);
+                                                     });
+    const double bucketedCoro = nanosecondsPerOperation(numOperations,
+                                                        [&ops]()
+                                                        {
+                                                            return processBucketsCoro(ops);
+                                                        });
+
+    std::println("{} ops per iteration:", numOperations);
+    std::println("  visit per op      {:8.2f} ns/op", visit);
+    std::println("  bucketed          {:8.2f} ns/op", bucketed);
+    std::println("  coro visit per op {:8.2f} ns/op", visitCoro);
+    std::println("  coro bucketed     {:8.2f} ns/op", bucketedCoro);
+}
+
+} // namespace
+
+int main()
+{
+    const std::string buffer = generateRandomString(2 * 1024 * 1024);
+    runFor(NUM_OPERATIONS, buffer);
+    runFor(100'000, buffer);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "append_log.hpp"
+
+#include "metrics.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <print>
+#include <sys/stat.h>
+#include <unistd.h>
+
+AppendLog::~AppendLog()
+{
+    close();
+}
+
+void AppendLog::close()
+{
+    for (File& file: mFiles)
+    {
+        const int fd = file.fd.exchange(-1, std::memory_order_relaxed);
+        if (fd != -1)
+        {
+            ::close(fd);
+            metrics::io().closeCalls.add();
+        }
+    }
+}
+
+bool AppendLog::append(const fs::path& path, std::string_view data)
+{
+    File* file = this->file(path);
+    if (file == nullptr)
+    {
+        return false;
+    }
+    const off_t offset = file->size.fetch_add(static_cast<off_t>(data.size()), std::memory_order_relaxed);
+    return writeRange(file->fd.load(std::memory_order_relaxed), data, offset);
+}
+
+bool AppendLog::writeAt(const fs::path& path, std::string_view data, off_t offset)
+{
+    File* file = this->file(path);
+    if (file == nullptr)
+    {
+        return false;
+    }
+    const off_t end = offset + static_cast<off_t>(data.size());
+    off_t size = file->size.load(std::memory_order_relaxed);
+    while (size < end && !file->size.compare_exchange_weak(size, end, std::memory_order_relaxed))
+    {
+    }
+    return writeRange(file->fd.load(std::memory_order_relaxed), data, offset);
+}
+
+AppendLog::File* AppendLog::file(const fs::path& path)
+{
+    const std::optional<size_t> index = dataFileIndex(path);
+    if (!index || *index >= MAX_FILE_INDEX)
+    {
+        std::println("append: {} is not a data file", path.string());
+        return nullptr;
+    }
+    File& file = mFiles[*index];
+    if (file.fd.load(std::memory_order_acquire) != -1)
+    {
+        return &file;
+    }
+
+    std::lock_guard<std::mutex> lock(mOpenMutex);
+    if (file.fd.load(std::memory_order_relaxed) != -1)
+    {
+        return &file;
+    }
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    metrics::io().openCalls.add();
+    if (fd == -1)
+    {
+        std::println("append: open failed");
+        return nullptr;
+    }
+    struct stat status;
+    if (fstat(fd, &status) == -1)
+    {
+        std::println("append: fstat failed");
+        ::close(fd);
+        metrics::io().closeCalls.add();
+        return nullptr;
+    }
+    // Published with the descriptor: no write can reserve a range before the
+    // size is known.
+    file.size.store(status.st_size, std::memory_order_relaxed);
+    file.fd.store(fd, std::memory_order_release);
+    return &file;
+}
+
+bool AppendLog::writeRange(int fd, std::string_view data, off_t offset)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        const ssize_t result =
+            pwrite(fd, data.data() + written, data.size() - written, offset + static_cast<off_t>(written));
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+        written += static_cast<size_t>(result);
+        if (written < data.size())
+        {
+            metrics::io().appendShortWrites.add();
+        }
+    }
+    metrics::io().bytesWritten.add(written);
+    if (written < data.size())
+    {
+        const size_t gap = data.size() - written;
+        metrics::io().appendGapBytes.add(gap);
+        std::println("append: write failed, {} bytes at offset {} left unwritten",
+                     gap,
+                     offset + static_cast<off_t>(written));
+        return false;
+    }
+    return true;
+}
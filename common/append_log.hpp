@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <string_view>
+#include <sys/types.h>
+
+#include "common/helpers.hpp"
+
+namespace fs = std::filesystem;
+
+// Writes to the data files through one cached descriptor per file.
+//
+// An append reserves its range with a fetch_add on the cached size of the file
+// and then pwrites into it, so concurrent appends to the same file land in
+// disjoint ranges without O_APPEND, a shared file offset or a reopen per
+// write. Only the first write to a file takes a lock, to open it.
+//
+// Appends never overlap each other or a range passed to writeAt, but writeAt
+// writes wherever it is told: chunked writes start at offset 0 and overwrite
+// whatever was there, appended bytes included.
+//
+// A write that fails part way leaves what it wrote so far on disk; only the
+// rest of its range is missing, read back as zero bytes once a later write
+// lands past it. Nothing is fsynced and no committed length is kept, so after a
+// crash a file may hold any mix of the writes that reached the page cache,
+// including partial ones.
+class AppendLog
+{
+public:
+    AppendLog() = default;
+    ~AppendLog();
+
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    // Appends `data` to the data file at `path`, creating it if needed.
+    // Returns false if any part of it could not be written.
+    bool append(const fs::path& path, std::string_view data);
+
+    // Writes `data` at `offset`, over whatever is there, moving the end of the
+    // file past it first so later appends do not overlap it.
+    bool writeAt(const fs::path& path, std::string_view data, off_t offset);
+
+    // Closes every open file; a later write reopens it. Must not run
+    // concurrently with writes.
+    void close();
+
+private:
+    struct File
+    {
+        std::atomic<int> fd{-1};
+        // Size of the file including the ranges reserved by writes in flight.
+        std::atomic<off_t> size{0};
+    };
+
+    // The file at `path`, opened on first use. nullptr if it cannot be opened.
+    File* file(const fs::path& path);
+
+    // Writes the whole range, retrying short writes. Returns false and counts
+    // the unwritten tail as a gap if the kernel reports an error.
+    static bool writeRange(int fd, std::string_view data, off_t offset);
+
+    std::array<File, MAX_FILE_INDEX> mFiles;
+    std::mutex mOpenMutex;
+};
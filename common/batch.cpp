@@ -0,0 +1,68 @@
+#include "batch.hpp"
+
+#include <print>
+#include <type_traits>
+
+CancellationToken iterationToken(const std::stop_source& stopSource, std::optional<std::chrono::milliseconds> budget)
+{
+    std::optional<CancellationToken::Clock::time_point> deadline;
+    if (budget)
+    {
+        deadline = CancellationToken::Clock::now() + *budget;
+    }
+    return {stopSource.get_token(), deadline};
+}
+
+bool writeToFile(AppendLog& appendLog, const fs::path& path, std::string_view data)
+{
+    return appendLog.append(path, data);
+}
+
+bool writeToFileInChunks(AppendLog& appendLog, const fs::path& path, std::string_view data, size_t nChunks)
+{
+    size_t totalSize = data.size();
+    size_t offset = 0;
+    size_t chunkSize = totalSize / nChunks;
+    while (offset < totalSize)
+    {
+        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
+        if (!appendLog.writeAt(path, data.substr(offset, currentChunkSize), static_cast<off_t>(offset)))
+        {
+            std::println("writeToFileInChunks: writeAt failed at offset {}", offset);
+            return false;
+        }
+        offset += currentChunkSize;
+    }
+    return true;
+}
+
+Outcome processOperation(const WriteOperation& writeOp, AppendLog& appendLog, const CancellationToken&)
+{
+    return outcomeOf(writeToFile(appendLog, writeOp.path, writeOp.data));
+}
+
+Outcome processOperation(const WriteInChunksOperation& writeOp, AppendLog& appendLog, const CancellationToken&)
+{
+    return outcomeOf(writeToFileInChunks(appendLog, writeOp.path, writeOp.data, writeOp.chunkSize));
+}
+
+void processWriteBuckets(OperationBuckets& operations,
+                         size_t iteration,
+                         oplog::Session& session,
+                         AppendLog& appendLog,
+                         const CancellationToken& token)
+{
+    static_assert(operationKind<ReadOperation> == 0, "the write kinds must follow the reads");
+    constexpr size_t firstWriteKind = 1;
+    constexpr size_t numWriteKinds = NUM_OPERATION_KINDS - firstWriteKind;
+    forEachBucketFrom(operations,
+                      firstWriteKind + iteration % numWriteKinds,
+                      [&](auto& bucket)
+                      {
+                          using Op = typename std::decay_t<decltype(bucket)>::value_type;
+                          if constexpr (!std::is_same_v<Op, ReadOperation>)
+                          {
+                              completeBatch(session, bucket, processBatch(bucket, token, appendLog));
+                          }
+                      });
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stop_token>
+#include <string_view>
+#include <vector>
+
+#include "common/append_log.hpp"
+#include "common/cancellation.hpp"
+#include "common/helpers.hpp"
+#include "common/metrics.hpp"
+#include "common/oplog.hpp"
+
+// Token for the operations of a new iteration, cancelled by a stop requested
+// on `stopSource` or once `budget` elapses.
+CancellationToken iterationToken(const std::stop_source& stopSource, std::optional<std::chrono::milliseconds> budget);
+
+bool writeToFile(AppendLog& appendLog, const fs::path& path, std::string_view data);
+bool writeToFileInChunks(AppendLog& appendLog, const fs::path& path, std::string_view data, size_t nChunks);
+
+// Writes are short and run on the owner thread, so once started they are not
+// interrupted. Reads are up to each engine.
+Outcome processOperation(const WriteOperation& writeOp, AppendLog& appendLog, const CancellationToken& token);
+Outcome processOperation(const WriteInChunksOperation& writeOp, AppendLog& appendLog, const CancellationToken& token);
+
+// Operations not started by the time `token` is cancelled are reported as
+// cancelled. `context` is whatever else the kind's processOperation takes.
+template<class Op, class... Context>
+std::vector<Outcome> processBatch(const std::vector<Op>& ops, const CancellationToken& token, Context&... context)
+{
+    std::vector<Outcome> outcomes(ops.size(), Outcome::Cancelled);
+    for (size_t i = 0; i < ops.size() && !token.cancelled(); ++i)
+    {
+        outcomes[i] = processOperation(ops[i], context..., token);
+    }
+    return outcomes;
+}
+
+// Reports the outcomes of a processed bucket to `session` and the metrics, then
+// requeues it: removed operations are erased and cancelled ones moved first.
+template<class Op>
+void completeBatch(oplog::Session& session, std::vector<Op>& ops, const std::vector<Outcome>& outcomes)
+{
+    session.completeBatch(ops, outcomes);
+    metrics::io().opsTotal[operationKind<Op>]->add(ops.size());
+    metrics::io().opsCancelled[operationKind<Op>]->add(
+        static_cast<uint64_t>(std::ranges::count(outcomes, Outcome::Cancelled)));
+    metrics::io().opsRemoved[operationKind<Op>]->add(requeueBatch(ops, outcomes));
+}
+
+// Processes and completes every write bucket, leaving the reads to the engine.
+// The write kinds take turns going first (see `forEachBucketFrom`) so a
+// deadline cannot starve the one that would otherwise always run last.
+void processWriteBuckets(OperationBuckets& operations,
+                         size_t iteration,
+                         oplog::Session& session,
+                         AppendLog& appendLog,
+                         const CancellationToken& token);
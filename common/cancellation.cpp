@@ -0,0 +1,64 @@
+#include "cancellation.hpp"
+
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <print>
+#include <string_view>
+
+std::optional<std::chrono::milliseconds> iterationBudgetFromEnvironment()
+{
+    const char* value = std::getenv("ITERATION_DEADLINE_MS");
+    if (value == nullptr)
+    {
+        return std::nullopt;
+    }
+    const std::string_view text(value);
+    long long milliseconds = 0;
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), milliseconds);
+    if (ec != std::errc{} || end != text.data() + text.size() || milliseconds <= 0)
+    {
+        return std::nullopt;
+    }
+    return std::chrono::milliseconds{milliseconds};
+}
+
+namespace
+{
+
+sigset_t shutdownSignalSet()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    return set;
+}
+
+} // namespace
+
+ShutdownSignals::ShutdownSignals()
+{
+    const sigset_t set = shutdownSignalSet();
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    mWatcher = std::jthread(
+        [this, set](std::stop_token stopToken)
+        {
+            // Polls so the watcher notices the end of the run and can be joined.
+            const timespec pollInterval{0, 100'000'000};
+            while (!stopToken.stop_requested())
+            {
+                const int signal = sigtimedwait(&set, nullptr, &pollInterval);
+                if (signal == -1)
+                {
+                    continue;
+                }
+                if (mStopSource.stop_requested())
+                {
+                    std::_Exit(128 + signal);
+                }
+                std::println("shutdown: received signal {}, stopping after the current iteration", signal);
+                mStopSource.request_stop();
+            }
+        });
+}
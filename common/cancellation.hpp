@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <utility>
+
+// Cooperative cancellation of the operations of an iteration. Cancelled once a
+// stop is requested on the source the token comes from, or once the deadline
+// passes. Long running work polls `cancelled()` between units of work.
+class CancellationToken
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A token that is never cancelled.
+    CancellationToken() = default;
+
+    CancellationToken(std::stop_token stopToken, std::optional<Clock::time_point> deadline)
+        : mStopToken(std::move(stopToken)), mDeadline(deadline)
+    {
+    }
+
+    bool cancelled() const
+    {
+        return mStopToken.stop_requested() || (mDeadline && Clock::now() >= *mDeadline);
+    }
+
+private:
+    std::stop_token mStopToken;
+    std::optional<Clock::time_point> mDeadline;
+};
+
+// Time budget of an iteration from ITERATION_DEADLINE_MS, if set.
+std::optional<std::chrono::milliseconds> iterationBudgetFromEnvironment();
+
+// Turns SIGINT and SIGTERM into a stop request on `stopSource()`. Blocks both
+// signals in the calling thread, and so in every thread it creates afterwards,
+// and waits for them on a thread of its own, where requesting a stop is safe.
+// A second signal exits right away. Must be created before any other thread.
+class ShutdownSignals
+{
+public:
+    ShutdownSignals();
+
+    ShutdownSignals(const ShutdownSignals&) = delete;
+    ShutdownSignals& operator=(const ShutdownSignals&) = delete;
+
+    std::stop_source stopSource() const
+    {
+        return mStopSource;
+    }
+
+private:
+    std::stop_source mStopSource;
+    // Declared last so it is joined before the stop source goes away.
+    std::jthread mWatcher;
+};
@@ -1,21 +1,80 @@
 #include "helpers.hpp"
 
+#include <charconv>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string_view>
+#include <unistd.h>
+
+
+namespace
+{
+
+void fillRandom(std::span<char> data)
+{
+    for (char& c: data)
+    {
+        c = static_cast<char>('A' + (rand() % 26));
+    }
+}
+
+} // namespace
+
+fs::path dataFilePath(size_t index)
+{
+    return fs::path("file_" + std::to_string(index) + ".txt");
+}
+
+std::optional<size_t> dataFileIndex(const fs::path& path)
+{
+    const std::string name = path.stem().string();
+    const size_t separator = name.find('_');
+    if (separator == std::string::npos)
+    {
+        return std::nullopt;
+    }
+    const char* begin = name.data() + separator + 1;
+    const char* end = name.data() + name.size();
+    size_t index = 0;
+    const auto [last, ec] = std::from_chars(begin, end, index);
+    if (ec != std::errc{} || last != end)
+    {
+        return std::nullopt;
+    }
+    return index;
+}
+
+void removeDataFiles()
+{
+    for (size_t i = 0; i < MAX_FILE_INDEX; ++i)
+    {
+        fs::path path = dataFilePath(i);
+        if (fs::exists(path))
+        {
+            fs::remove(path);
+        }
+    }
+}
 
 std::string generateRandomString(size_t length)
 {
     std::string str;
     str.resize(length);
-    for (size_t i = 0; i < length; ++i)
-    {
-        str[i] = 'A' + (rand() % 26);
-    }
+    fillRandom(str);
     return str;
 }
 
-Operation createRandomOperation(const std::string& buffer)
+topology::NodeLocalBuffer generateRandomBuffer(size_t length, int node)
+{
+    topology::NodeLocalBuffer buffer(length, node);
+    fillRandom(buffer.span());
+    return buffer;
+}
+
+Operation createRandomOperation(std::string_view buffer)
 {
     const auto dice = rand() % 3;
-    const fs::path filePath{"file_" + std::to_string(static_cast<size_t>(rand()) % MAX_FILE_INDEX) + ".txt"};
+    const fs::path filePath = dataFilePath(static_cast<size_t>(rand()) % MAX_FILE_INDEX);
     if (dice == 0)
     {
         return ReadOperation{filePath};
@@ -32,3 +91,59 @@ Operation createRandomOperation(const std::string& buffer)
         return WriteInChunksOperation{filePath, dataView, nChunks};
     }
 }
+
+bool coldCacheMode()
+{
+    static const bool cold = []
+    {
+        const char* value = std::getenv("COLD_CACHE");
+        return value != nullptr && std::string_view(value) == "1";
+    }();
+    return cold;
+}
+
+void evictFromPageCacheIfCold(int fd)
+{
+    if (!coldCacheMode())
+    {
+        return;
+    }
+    // Dirty pages cannot be dropped, so flush whatever the writes left behind.
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+std::string_view operationKindName(size_t index)
+{
+    switch (index)
+    {
+    case 0:
+        return "read";
+    case 1:
+        return "write";
+    case 2:
+        return "write_in_chunks";
+    default:
+        return "unknown";
+    }
+}
+
+void addOperation(OperationBuckets& buckets, Operation&& op)
+{
+    std::visit(
+        [&buckets]<class Op>(Op&& concrete)
+        {
+            std::get<std::vector<std::decay_t<Op>>>(buckets).push_back(std::forward<Op>(concrete));
+        },
+        std::move(op));
+}
+
+size_t operationCount(const OperationBuckets& buckets)
+{
+    return std::apply(
+        [](const auto&... bucket)
+        {
+            return (bucket.size() + ...);
+        },
+        buckets);
+}
@@ -1,8 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <filesystem>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "common/topology.hpp"
 
 namespace fs = std::filesystem;
 
@@ -10,6 +19,9 @@ constexpr size_t MAX_FILE_INDEX = 100;
 constexpr size_t NUM_OPERATIONS = 200;
 constexpr size_t NUM_ITERATIONS = 10;
 constexpr size_t NUM_THREADS = 4;
+// Bounds for the adaptive pool size, which starts at NUM_THREADS.
+constexpr size_t MIN_THREADS = 2;
+constexpr size_t MAX_THREADS = 32;
 
 struct ReadOperation
 {
@@ -37,7 +49,141 @@ struct overloaded: Ts...
 
 using Operation = std::variant<ReadOperation, WriteOperation, WriteInChunksOperation>;
 
+constexpr size_t NUM_OPERATION_KINDS = std::variant_size_v<Operation>;
+
+// Name of the operation kind stored at `index` in `Operation`.
+std::string_view operationKindName(size_t index);
+
+template<class Op, class Variant>
+struct OperationKindOf;
+
+template<class Op, class... Ops>
+struct OperationKindOf<Op, std::variant<Ops...>>
+{
+    static constexpr size_t value = []
+    {
+        constexpr bool matches[] = {std::is_same_v<Op, Ops>...};
+        size_t index = 0;
+        while (!matches[index])
+        {
+            ++index;
+        }
+        return index;
+    }();
+};
+
+// Index of `Op` in `Operation`, i.e. the value `Operation::index()` returns
+// when holding an `Op`.
+template<class Op>
+constexpr size_t operationKind = OperationKindOf<Op, Operation>::value;
+
+template<class Variant>
+struct OperationBucketsOf;
+
+template<class... Ops>
+struct OperationBucketsOf<std::variant<Ops...>>
+{
+    using type = std::tuple<std::vector<Ops>...>;
+};
+
+// Operations grouped by kind, one vector per `Operation` alternative in the
+// same order. Lets each kind be processed by its own batch handler instead of
+// dispatching every single operation through `std::visit`.
+using OperationBuckets = OperationBucketsOf<Operation>::type;
+
+void addOperation(OperationBuckets& buckets, Operation&& op);
+size_t operationCount(const OperationBuckets& buckets);
+
+// What happened to an operation in an iteration.
+enum class Outcome : char
+{
+    Kept = 0,
+    Removed = 1,
+    // Stopped before completing, because the iteration deadline passed or a
+    // stop was requested. Kept for a later iteration.
+    Cancelled = 2,
+};
+
+inline Outcome outcomeOf(bool remove)
+{
+    return remove ? Outcome::Removed : Outcome::Kept;
+}
+
+// Drops from `ops` every element whose outcome is `Outcome::Removed` and moves
+// the cancelled ones to the front, so they are the first to run in the next
+// iteration. Otherwise keeps the relative order. Returns the number of removed
+// elements.
+template<class Op>
+size_t requeueBatch(std::vector<Op>& ops, const std::vector<Outcome>& outcomes)
+{
+    const size_t size = ops.size();
+    if (std::find(outcomes.begin(), outcomes.end(), Outcome::Cancelled) == outcomes.end())
+    {
+        // Nothing to move ahead: compact in place, without allocating.
+        size_t kept = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (outcomes[i] != Outcome::Removed)
+            {
+                if (kept != i)
+                {
+                    ops[kept] = std::move(ops[i]);
+                }
+                ++kept;
+            }
+        }
+        ops.erase(ops.begin() + static_cast<std::ptrdiff_t>(kept), ops.end());
+        return size - kept;
+    }
+    std::vector<Op> requeued;
+    requeued.reserve(size);
+    for (Outcome first: {Outcome::Cancelled, Outcome::Kept})
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (outcomes[i] == first)
+            {
+                requeued.push_back(std::move(ops[i]));
+            }
+        }
+    }
+    ops = std::move(requeued);
+    return size - ops.size();
+}
+
+// Calls `fn` on every bucket, starting with the one of kind
+// `first % NUM_OPERATION_KINDS` and wrapping around. Rotating `first` across
+// iterations keeps a deadline from always cutting the same kind short.
+template<class Fn>
+void forEachBucketFrom(OperationBuckets& buckets, size_t first, Fn&& fn)
+{
+    for (size_t i = 0; i < NUM_OPERATION_KINDS; ++i)
+    {
+        const size_t kind = (first + i) % NUM_OPERATION_KINDS;
+        std::apply(
+            [kind, &fn](auto&... bucket)
+            {
+                size_t index = 0;
+                ((index++ == kind ? fn(bucket) : void()), ...);
+            },
+            buckets);
+    }
+}
+
+// Path of the `index`-th file operations work on, and the other way around.
+// std::nullopt if `path` is not named like a data file.
+fs::path dataFilePath(size_t index);
+std::optional<size_t> dataFileIndex(const fs::path& path);
+void removeDataFiles();
+
 std::string generateRandomString(size_t length);
-Operation createRandomOperation(const std::string& buffer);
+// Same contents as `generateRandomString` but allocated on the given NUMA node.
+topology::NodeLocalBuffer generateRandomBuffer(size_t length, int node);
+Operation createRandomOperation(std::string_view buffer);
+
+// True when COLD_CACHE=1 is set: reads then evict the file from the page cache
+// first so they hit the disk.
+bool coldCacheMode();
+void evictFromPageCacheIfCold(int fd);
 
 
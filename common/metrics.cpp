@@ -0,0 +1,305 @@
+#include "metrics.hpp"
+
+#include <bit>
+#include <fstream>
+
+namespace metrics
+{
+
+size_t currentShard()
+{
+    static std::atomic<size_t> nextShard{0};
+    thread_local const size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+    return shard;
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for (const Shard& shard: mShards)
+    {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Histogram::bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return static_cast<size_t>(value);
+    }
+    const size_t exponent = static_cast<size_t>(std::bit_width(value)) - 1;
+    const size_t shift = exponent - SUB_BUCKET_BITS;
+    const size_t subBucket = static_cast<size_t>(value >> shift) & (SUB_BUCKETS - 1);
+    return (shift + 1) * SUB_BUCKETS + subBucket;
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot result;
+    result.counts.assign(NUM_BUCKETS, 0);
+    for (const Shard& shard: mShards)
+    {
+        for (size_t i = 0; i < NUM_BUCKETS; ++i)
+        {
+            const uint64_t count = shard.counts[i].load(std::memory_order_relaxed);
+            result.counts[i] += count;
+            result.count += count;
+        }
+        result.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+Registry& Registry::instance()
+{
+    static Registry registry;
+    return registry;
+}
+
+void* Registry::find(const std::string& name, const std::string& labels, Type type) const
+{
+    for (const Family& family: mFamilies)
+    {
+        if (family.name != name || family.type != type)
+        {
+            continue;
+        }
+        for (const Series& series: family.series)
+        {
+            if (series.labels == labels)
+            {
+                return series.metric;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void Registry::add(const std::string& name,
+                   const std::string& help,
+                   const std::string& labels,
+                   Type type,
+                   void* metric)
+{
+    for (Family& family: mFamilies)
+    {
+        if (family.name == name)
+        {
+            family.series.push_back({labels, metric});
+            return;
+        }
+    }
+    mFamilies.push_back({name, help, type, {{labels, metric}}});
+}
+
+Counter& Registry::counter(const std::string& name, const std::string& help, const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (void* existing = find(name, labels, Type::Counter))
+    {
+        return *static_cast<Counter*>(existing);
+    }
+    Counter& counter = mCounters.emplace_back();
+    add(name, help, labels, Type::Counter, &counter);
+    return counter;
+}
+
+Gauge& Registry::gauge(const std::string& name, const std::string& help, const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (void* existing = find(name, labels, Type::Gauge))
+    {
+        return *static_cast<Gauge*>(existing);
+    }
+    Gauge& gauge = mGauges.emplace_back();
+    add(name, help, labels, Type::Gauge, &gauge);
+    return gauge;
+}
+
+Histogram& Registry::histogram(const std::string& name, const std::string& help, const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (void* existing = find(name, labels, Type::Histogram))
+    {
+        return *static_cast<Histogram*>(existing);
+    }
+    Histogram& histogram = mHistograms.emplace_back();
+    add(name, help, labels, Type::Histogram, &histogram);
+    return histogram;
+}
+
+namespace
+{
+
+std::string withLabels(const std::string& name, const std::string& labels, const std::string& extra = "")
+{
+    if (labels.empty() && extra.empty())
+    {
+        return name;
+    }
+    if (labels.empty() || extra.empty())
+    {
+        return name + "{" + labels + extra + "}";
+    }
+    return name + "{" + labels + "," + extra + "}";
+}
+
+void writeHistogram(std::ostream& out, const std::string& name, const std::string& labels, const Histogram& histogram)
+{
+    // Prometheus wants cumulative buckets with stable bounds, so the fine
+    // grained HDR buckets are folded into one bucket per power of two, and
+    // every bound is written on every dump, even once all samples are counted.
+    const Histogram::Snapshot snapshot = histogram.snapshot();
+    uint64_t cumulative = 0;
+    size_t index = 0;
+    for (size_t bit = 0; bit < 64; ++bit)
+    {
+        const size_t end = Histogram::bucketIndex(uint64_t{1} << bit);
+        for (; index < end; ++index)
+        {
+            cumulative += snapshot.counts[index];
+        }
+        const uint64_t bound = (uint64_t{1} << bit) - 1;
+        out << withLabels(name + "_bucket", labels, "le=\"" + std::to_string(bound) + "\"") << ' '
+            << cumulative << '\n';
+    }
+    out << withLabels(name + "_bucket", labels, "le=\"+Inf\"") << ' ' << snapshot.count << '\n';
+    out << withLabels(name + "_sum", labels) << ' ' << snapshot.sum << '\n';
+    out << withLabels(name + "_count", labels) << ' ' << snapshot.count << '\n';
+}
+
+} // namespace
+
+void Registry::writePrometheus(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const Family& family: mFamilies)
+    {
+        out << "# HELP " << family.name << ' ' << family.help << '\n';
+        switch (family.type)
+        {
+        case Type::Counter:
+            out << "# TYPE " << family.name << " counter\n";
+            for (const Series& series: family.series)
+            {
+                out << withLabels(family.name, series.labels) << ' '
+                    << static_cast<const Counter*>(series.metric)->value() << '\n';
+            }
+            break;
+        case Type::Gauge:
+            out << "# TYPE " << family.name << " gauge\n";
+            for (const Series& series: family.series)
+            {
+                out << withLabels(family.name, series.labels) << ' '
+                    << static_cast<const Gauge*>(series.metric)->value() << '\n';
+            }
+            break;
+        case Type::Histogram:
+            out << "# TYPE " << family.name << " histogram\n";
+            for (const Series& series: family.series)
+            {
+                writeHistogram(out, family.name, series.labels, *static_cast<const Histogram*>(series.metric));
+            }
+            break;
+        }
+    }
+}
+
+bool Registry::dumpToFile(const fs::path& path) const
+{
+    fs::path tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        writePrometheus(out);
+        if (!out)
+        {
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+PeriodicDumper::PeriodicDumper(fs::path path, std::chrono::milliseconds interval)
+    : mPath(std::move(path)), mInterval(interval), mLastDump(std::chrono::steady_clock::now())
+{
+}
+
+void PeriodicDumper::tick()
+{
+    if (std::chrono::steady_clock::now() - mLastDump >= mInterval)
+    {
+        dump();
+    }
+}
+
+void PeriodicDumper::dump()
+{
+    Registry::instance().dumpToFile(mPath);
+    mLastDump = std::chrono::steady_clock::now();
+}
+
+IoMetrics& io()
+{
+    static IoMetrics metrics = []
+    {
+        Registry& registry = Registry::instance();
+        std::array<Counter*, NUM_OPERATION_KINDS> opsTotal;
+        std::array<Counter*, NUM_OPERATION_KINDS> opsRemoved;
+        std::array<Counter*, NUM_OPERATION_KINDS> opsCancelled;
+        for (size_t kind = 0; kind < NUM_OPERATION_KINDS; ++kind)
+        {
+            const std::string labels = "kind=\"" + std::string(operationKindName(kind)) + "\"";
+            opsTotal[kind] = &registry.counter("iobench_ops_total", "Operations processed.", labels);
+            opsRemoved[kind] =
+                &registry.counter("iobench_ops_removed_total", "Operations removed after processing.", labels);
+            opsCancelled[kind] = &registry.counter("iobench_ops_cancelled_total",
+                                                   "Operations stopped by a deadline or a stop request.",
+                                                   labels);
+        }
+        return IoMetrics{
+            .opsTotal = opsTotal,
+            .opsRemoved = opsRemoved,
+            .opsCancelled = opsCancelled,
+            .opsInFlight = registry.gauge("iobench_ops_in_flight", "Operations handed off and not yet completed."),
+            .bytesRead = registry.counter("iobench_read_bytes_total", "Bytes read from data files."),
+            .bytesWritten = registry.counter("iobench_written_bytes_total", "Bytes written to data files."),
+            .openCalls = registry.counter("iobench_syscalls_total", "Syscalls issued.", "call=\"open\""),
+            .closeCalls = registry.counter("iobench_syscalls_total", "Syscalls issued.", "call=\"close\""),
+            .appendShortWrites =
+                registry.counter("iobench_append_short_writes_total", "pwrite calls that wrote part of their range."),
+            .appendGapBytes = registry.counter("iobench_append_gap_bytes_total",
+                                               "Reserved bytes left unwritten after a failed write."),
+            .poolQueueDepth = registry.gauge("iobench_pool_queue_depth", "Tasks waiting in the thread pool queue."),
+            .poolTaskWaitNs = registry.histogram("iobench_pool_task_wait_ns",
+                                                 "Time between handing a task to the pool and it starting, in ns."),
+            .threadPoolHops =
+                registry.counter("iobench_pool_hops_total", "Coroutine resumptions on another executor.", "to=\"thread_pool\""),
+            .schedulerHops =
+                registry.counter("iobench_pool_hops_total", "Coroutine resumptions on another executor.", "to=\"io_scheduler\""),
+            .poolBusyNs = registry.counter("iobench_pool_busy_ns_total", "Wall time pool workers spent running tasks, in ns."),
+            .poolBlockedNs = registry.counter("iobench_pool_blocked_ns_total",
+                                              "Part of the busy time pool workers were blocked, in ns."),
+            .poolPreemptedNs = registry.counter("iobench_pool_preempted_ns_total",
+                                                "Part of the busy time pool workers waited for a CPU, in ns."),
+            .poolSize = registry.gauge("iobench_pool_size", "Current number of pool workers."),
+            .poolBlockedPermille = registry.gauge("iobench_pool_blocked_permille",
+                                                  "Blocked fraction of busy time seen by the last sizing decision."),
+            .poolMeanWaitNs = registry.gauge("iobench_pool_mean_wait_ns",
+                                             "Mean queue wait seen by the last sizing decision, in ns."),
+            .poolGrows = registry.counter("iobench_pool_resizes_total", "Pool sizing decisions.", "direction=\"grow\""),
+            .poolShrinks = registry.counter("iobench_pool_resizes_total", "Pool sizing decisions.", "direction=\"shrink\""),
+        };
+    }();
+    return metrics;
+}
+
+} // namespace metrics
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common/helpers.hpp"
+
+namespace fs = std::filesystem;
+
+namespace metrics
+{
+
+// Number of per-thread slots each metric is split into. Threads are assigned
+// a slot round-robin on first use, so the hot path never shares a cache line
+// with another thread as long as there are at most NUM_SHARDS of them.
+constexpr size_t NUM_SHARDS = 16;
+
+size_t currentShard();
+
+class Counter
+{
+public:
+    void add(uint64_t n = 1)
+    {
+        mShards[currentShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value{0};
+    };
+
+    std::array<Shard, NUM_SHARDS> mShards;
+};
+
+class Gauge
+{
+public:
+    void set(int64_t value)
+    {
+        mValue.store(value, std::memory_order_relaxed);
+    }
+
+    void add(int64_t n = 1)
+    {
+        mValue.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const
+    {
+        return mValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> mValue{0};
+};
+
+// HDR-style log-linear histogram: every power of two is split into
+// 2^SUB_BUCKET_BITS linear buckets, which bounds the relative error to 12.5%
+// over the whole uint64_t range with a fixed number of buckets.
+class Histogram
+{
+public:
+    static constexpr size_t SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+    static constexpr size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    struct Snapshot
+    {
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+    };
+
+    static size_t bucketIndex(uint64_t value);
+
+    void record(uint64_t value)
+    {
+        Shard& shard = mShards[currentShard()];
+        shard.counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::nanoseconds duration)
+    {
+        record(static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0)));
+    }
+
+    Snapshot snapshot() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::array<std::atomic<uint64_t>, NUM_BUCKETS> counts{};
+        std::atomic<uint64_t> sum{0};
+    };
+
+    std::array<Shard, NUM_SHARDS> mShards;
+};
+
+// Owns every metric of the process. Registration takes a lock and is meant to
+// happen once at startup; the returned references stay valid for the lifetime
+// of the registry and can be updated from any thread without locking.
+class Registry
+{
+public:
+    static Registry& instance();
+
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    Histogram& histogram(const std::string& name,
+                         const std::string& help,
+                         const std::string& labels = "");
+
+    void writePrometheus(std::ostream& out) const;
+    // Writes to a temporary file next to `path` and renames it over, so a
+    // scraper never observes a half written file.
+    bool dumpToFile(const fs::path& path) const;
+
+private:
+    enum class Type
+    {
+        Counter,
+        Gauge,
+        Histogram,
+    };
+
+    struct Series
+    {
+        std::string labels;
+        void* metric;
+    };
+
+    struct Family
+    {
+        std::string name;
+        std::string help;
+        Type type;
+        std::vector<Series> series;
+    };
+
+    void* find(const std::string& name, const std::string& labels, Type type) const;
+    void add(const std::string& name, const std::string& help, const std::string& labels, Type type, void* metric);
+
+    mutable std::mutex mMutex;
+    std::vector<Family> mFamilies;
+    std::deque<Counter> mCounters;
+    std::deque<Gauge> mGauges;
+    std::deque<Histogram> mHistograms;
+};
+
+// Dumps the registry to a file at most once per interval. Meant to be ticked
+// from an event loop.
+class PeriodicDumper
+{
+public:
+    PeriodicDumper(fs::path path, std::chrono::milliseconds interval);
+
+    void tick();
+    void dump();
+
+private:
+    fs::path mPath;
+    std::chrono::milliseconds mInterval;
+    std::chrono::steady_clock::time_point mLastDump;
+};
+
+constexpr std::chrono::milliseconds DUMP_INTERVAL{100};
+
+// The metrics shared by the three engines.
+struct IoMetrics
+{
+    std::array<Counter*, NUM_OPERATION_KINDS> opsTotal;
+    std::array<Counter*, NUM_OPERATION_KINDS> opsRemoved;
+    std::array<Counter*, NUM_OPERATION_KINDS> opsCancelled;
+    Gauge& opsInFlight;
+
+    Counter& bytesRead;
+    Counter& bytesWritten;
+
+    Counter& openCalls;
+    Counter& closeCalls;
+
+    Counter& appendShortWrites;
+    Counter& appendGapBytes;
+
+    Gauge& poolQueueDepth;
+    Histogram& poolTaskWaitNs;
+    Counter& threadPoolHops;
+    Counter& schedulerHops;
+
+    Counter& poolBusyNs;
+    Counter& poolBlockedNs;
+    Counter& poolPreemptedNs;
+    Gauge& poolSize;
+    Gauge& poolBlockedPermille;
+    Gauge& poolMeanWaitNs;
+    Counter& poolGrows;
+    Counter& poolShrinks;
+};
+
+IoMetrics& io();
+
+} // namespace metrics
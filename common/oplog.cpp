@@ -0,0 +1,338 @@
+#include "oplog.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <print>
+
+namespace oplog
+{
+
+namespace
+{
+
+constexpr char MAGIC[4] = {'O', 'P', 'L', 'G'};
+
+void writeVarint(std::ostream& out, uint64_t value)
+{
+    char bytes[10];
+    size_t size = 0;
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+        {
+            byte |= 0x80;
+        }
+        bytes[size++] = static_cast<char>(byte);
+    } while (value != 0);
+    out.write(bytes, static_cast<std::streamsize>(size));
+}
+
+std::optional<uint64_t> readVarint(std::istream& in)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        const int byte = in.get();
+        if (byte == std::char_traits<char>::eof())
+        {
+            return std::nullopt;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+uint64_t offsetIn(std::string_view buffer, std::string_view data)
+{
+    return static_cast<uint64_t>(data.data() - buffer.data());
+}
+
+void writeFields(std::ostream&, std::string_view, const ReadOperation&)
+{
+}
+
+void writeFields(std::ostream& out, std::string_view buffer, const WriteOperation& op)
+{
+    writeVarint(out, offsetIn(buffer, op.data));
+    writeVarint(out, op.data.size());
+}
+
+void writeFields(std::ostream& out, std::string_view buffer, const WriteInChunksOperation& op)
+{
+    writeVarint(out, offsetIn(buffer, op.data));
+    writeVarint(out, op.data.size());
+    writeVarint(out, op.chunkSize);
+}
+
+std::optional<std::string_view> readData(std::istream& in, std::string_view buffer)
+{
+    const auto offset = readVarint(in);
+    const auto length = readVarint(in);
+    if (!offset || !length || *offset > buffer.size() || *length > buffer.size() - *offset)
+    {
+        return std::nullopt;
+    }
+    return buffer.substr(*offset, *length);
+}
+
+std::optional<ReadOperation> readFields(std::istream&, std::string_view, fs::path path, ReadOperation*)
+{
+    return ReadOperation{std::move(path)};
+}
+
+std::optional<WriteOperation> readFields(std::istream& in, std::string_view buffer, fs::path path, WriteOperation*)
+{
+    const auto data = readData(in, buffer);
+    if (!data)
+    {
+        return std::nullopt;
+    }
+    return WriteOperation{std::move(path), *data};
+}
+
+std::optional<WriteInChunksOperation> readFields(std::istream& in,
+                                                 std::string_view buffer,
+                                                 fs::path path,
+                                                 WriteInChunksOperation*)
+{
+    const auto data = readData(in, buffer);
+    const auto chunks = readVarint(in);
+    if (!data || !chunks || *chunks == 0)
+    {
+        return std::nullopt;
+    }
+    return WriteInChunksOperation{std::move(path), *data, *chunks};
+}
+
+template<class Op>
+void writeBucket(std::ostream& out,
+                 std::string_view buffer,
+                 const std::vector<Op>& ops,
+                 const std::vector<Outcome>& outcomes)
+{
+    writeVarint(out, ops.size());
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        out.put(static_cast<char>(i < outcomes.size() ? outcomes[i] : Outcome::Kept));
+        // Not a valid index, so a path that is not a data file fails on replay.
+        writeVarint(out, dataFileIndex(ops[i].path).value_or(MAX_FILE_INDEX));
+        writeFields(out, buffer, ops[i]);
+    }
+}
+
+template<class Op>
+bool readBucket(std::istream& in, std::string_view buffer, std::vector<Op>& ops, std::vector<Outcome>& outcomes)
+{
+    ops.clear();
+    outcomes.clear();
+    const auto count = readVarint(in);
+    if (!count)
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < *count; ++i)
+    {
+        const int outcome = in.get();
+        const auto fileIndex = readVarint(in);
+        if (outcome < 0 || outcome > static_cast<int>(Outcome::Cancelled) || !fileIndex ||
+            *fileIndex >= MAX_FILE_INDEX)
+        {
+            return false;
+        }
+        auto op = readFields(in, buffer, dataFilePath(*fileIndex), static_cast<Op*>(nullptr));
+        if (!op)
+        {
+            return false;
+        }
+        ops.push_back(std::move(*op));
+        outcomes.push_back(static_cast<Outcome>(outcome));
+    }
+    return true;
+}
+
+std::optional<uint64_t> unsignedFromEnvironment(const char* name)
+{
+    const char* value = std::getenv(name);
+    if (value == nullptr)
+    {
+        return std::nullopt;
+    }
+    const std::string_view text(value);
+    uint64_t result = 0;
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), result);
+    if (ec != std::errc{} || end != text.data() + text.size())
+    {
+        return std::nullopt;
+    }
+    return result;
+}
+
+} // namespace
+
+Writer::Writer(const fs::path& path, const Header& header) : mOut(path, std::ios::binary | std::ios::trunc)
+{
+    mOut.write(MAGIC, sizeof(MAGIC));
+    mOut.put(static_cast<char>(VERSION));
+    writeVarint(mOut, header.seed);
+    writeVarint(mOut, header.bufferSize);
+}
+
+void Writer::write(const Iteration& iteration, std::string_view buffer)
+{
+    writeVarint(mOut, iteration.index);
+    std::apply(
+        [this, &iteration, buffer](const auto&... bucket)
+        {
+            size_t kind = 0;
+            (writeBucket(mOut, buffer, bucket, iteration.outcomes[kind++]), ...);
+        },
+        iteration.operations);
+    mOut.flush();
+}
+
+Reader::Reader(const fs::path& path) : mIn(path, std::ios::binary)
+{
+    char magic[sizeof(MAGIC)];
+    if (!mIn.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MAGIC))
+    {
+        return;
+    }
+    const int version = mIn.get();
+    if (version < 1 || version > VERSION)
+    {
+        return;
+    }
+    const auto seed = readVarint(mIn);
+    const auto bufferSize = readVarint(mIn);
+    if (seed && bufferSize)
+    {
+        mHeader = Header{*seed, *bufferSize};
+    }
+}
+
+bool Reader::next(Iteration& iteration, std::string_view buffer)
+{
+    if (!mHeader || mIn.peek() == std::char_traits<char>::eof())
+    {
+        return false;
+    }
+    const auto index = readVarint(mIn);
+    const bool complete = index && std::apply(
+                                       [this, &iteration, buffer](auto&... bucket)
+                                       {
+                                           size_t kind = 0;
+                                           return (readBucket(mIn, buffer, bucket, iteration.outcomes[kind++]) && ...);
+                                       },
+                                       iteration.operations);
+    if (!complete)
+    {
+        mCorrupt = true;
+        return false;
+    }
+    iteration.index = *index;
+    return true;
+}
+
+Session Session::fromEnvironment()
+{
+    Session session;
+    session.mSeed = unsignedFromEnvironment("SEED").value_or(1);
+    if (const char* replayPath = std::getenv("OPLOG_REPLAY"))
+    {
+        session.mReader.emplace(replayPath);
+        if (session.mReader->good())
+        {
+            session.mSeed = session.mReader->header().seed;
+        }
+        else
+        {
+            std::println("oplog: cannot read log {}", replayPath);
+            session.mReader.reset();
+        }
+    }
+    if (const char* recordPath = std::getenv("OPLOG_RECORD"))
+    {
+        session.mRecordPath = recordPath;
+    }
+    return session;
+}
+
+void Session::attachBuffer(std::string_view buffer)
+{
+    mBuffer = buffer;
+    if (mReader && mReader->header().bufferSize != buffer.size())
+    {
+        std::println("oplog: log was recorded with a {} byte buffer, not {}",
+                     mReader->header().bufferSize,
+                     buffer.size());
+        mReader.reset();
+    }
+    if (!mRecordPath.empty())
+    {
+        mWriter.emplace(mRecordPath, Header{mSeed, buffer.size()});
+        if (!mWriter->good())
+        {
+            std::println("oplog: cannot write log {}", mRecordPath.string());
+            mWriter.reset();
+        }
+    }
+}
+
+bool Session::beginIteration(OperationBuckets& operations)
+{
+    mCurrent.index = mNextIndex++;
+    if (!mReader)
+    {
+        return true;
+    }
+    if (!mReader->next(mCurrent, mBuffer))
+    {
+        if (mReader->corrupt())
+        {
+            std::println("oplog: replay log is truncated or corrupt after {} iterations", mCurrent.index);
+            mLogFailed = true;
+        }
+        return false;
+    }
+    operations = mCurrent.operations;
+    return true;
+}
+
+void Session::endIteration()
+{
+    if (mWriter)
+    {
+        mWriter->write(mCurrent, mBuffer);
+        if (!mWriter->good())
+        {
+            std::println("oplog: failed writing iteration {} to {}, recording stopped",
+                         mCurrent.index,
+                         mRecordPath.string());
+            mWriter.reset();
+            mLogFailed = true;
+        }
+    }
+}
+
+size_t Session::countMismatches(const std::vector<Outcome>& expected, const std::vector<Outcome>& actual)
+{
+    size_t mismatches = expected.size() > actual.size() ? expected.size() - actual.size()
+                                                        : actual.size() - expected.size();
+    for (size_t i = 0; i < std::min(expected.size(), actual.size()); ++i)
+    {
+        if (expected[i] != Outcome::Cancelled && actual[i] != Outcome::Cancelled && expected[i] != actual[i])
+        {
+            ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+} // namespace oplog
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "common/helpers.hpp"
+
+namespace fs = std::filesystem;
+
+// Binary log of the operations every iteration ran and their outcomes, used
+// to replay the exact same workload on any engine.
+//
+// Layout, all integers LEB128 varints unless noted:
+//   header:    "OPLG" u8:version seed bufferSize
+//   iteration: index, then for every Operation kind in variant order:
+//              count, count * (u8:outcome fileIndex kind-specific fields)
+//   read:             (nothing else)
+//   write:            offset length          (data is buffer[offset, +length))
+//   write in chunks:  offset length chunks
+namespace oplog
+{
+
+// Version 2 added `Outcome::Cancelled`; version 1 logs are still readable.
+constexpr uint8_t VERSION = 2;
+
+struct Header
+{
+    uint64_t seed = 0;
+    uint64_t bufferSize = 0;
+};
+
+struct Iteration
+{
+    uint64_t index = 0;
+    OperationBuckets operations;
+    // Outcome of every operation, per kind and in the same order.
+    std::array<std::vector<Outcome>, NUM_OPERATION_KINDS> outcomes;
+};
+
+class Writer
+{
+public:
+    Writer(const fs::path& path, const Header& header);
+
+    bool good() const
+    {
+        return mOut.good();
+    }
+
+    // `buffer` is the one the operations' data points into. Flushes the
+    // record, so `good()` tells whether it reached the file.
+    void write(const Iteration& iteration, std::string_view buffer);
+
+private:
+    std::ofstream mOut;
+};
+
+// Reads one iteration at a time, so traces never need to fit in memory.
+class Reader
+{
+public:
+    explicit Reader(const fs::path& path);
+
+    bool good() const
+    {
+        return mHeader.has_value();
+    }
+
+    const Header& header() const
+    {
+        return *mHeader;
+    }
+
+    // Fills `iteration` with the next record, pointing the operations' data
+    // into `buffer`. Returns false at the end of the log or on a corrupt one.
+    bool next(Iteration& iteration, std::string_view buffer);
+
+    // Whether `next` stopped on a truncated or corrupt record rather than at
+    // the end of the log.
+    bool corrupt() const
+    {
+        return mCorrupt;
+    }
+
+private:
+    std::ifstream mIn;
+    std::optional<Header> mHeader;
+    bool mCorrupt = false;
+};
+
+// Recording or replaying state of a run, configured from the environment:
+// - SEED=<n> seeds rand() (default 1, the sequence of an unseeded rand())
+// - OPLOG_RECORD=<path> writes every iteration to a log
+// - OPLOG_REPLAY=<path> runs the iterations of a log instead of random ones,
+//   taking the seed from it, and checks the outcomes match the recorded ones
+class Session
+{
+public:
+    static Session fromEnvironment();
+
+    uint64_t seed() const
+    {
+        return mSeed;
+    }
+
+    bool replaying() const
+    {
+        return mReader.has_value();
+    }
+
+    size_t mismatches() const
+    {
+        return mMismatches;
+    }
+
+    // Whether the log being recorded could not be written, or the one being
+    // replayed ended on a corrupt record. Either way the run is incomplete.
+    bool logFailed() const
+    {
+        return mLogFailed;
+    }
+
+    // Must be called once the buffer operations point into exists.
+    void attachBuffer(std::string_view buffer);
+
+    // Starts an iteration. When replaying, replaces `operations` with the
+    // recorded ones and returns false once the log is exhausted.
+    bool beginIteration(OperationBuckets& operations);
+
+    // Reports the outcome of a processed batch, before removed operations are
+    // erased from it.
+    template<class Op>
+    void completeBatch(const std::vector<Op>& ops, const std::vector<Outcome>& outcomes)
+    {
+        constexpr size_t kind = operationKind<Op>;
+        if (mReader)
+        {
+            mMismatches += countMismatches(mCurrent.outcomes[kind], outcomes);
+        }
+        if (mWriter)
+        {
+            std::get<std::vector<Op>>(mCurrent.operations) = ops;
+            mCurrent.outcomes[kind] = outcomes;
+        }
+    }
+
+    void endIteration();
+
+private:
+    // Cancellations depend on timing, so they never count as a mismatch.
+    static size_t countMismatches(const std::vector<Outcome>& expected, const std::vector<Outcome>& actual);
+
+    uint64_t mSeed = 1;
+    fs::path mRecordPath;
+    std::string_view mBuffer;
+    std::optional<Writer> mWriter;
+    std::optional<Reader> mReader;
+    Iteration mCurrent;
+    uint64_t mNextIndex = 0;
+    size_t mMismatches = 0;
+    bool mLogFailed = false;
+};
+
+} // namespace oplog
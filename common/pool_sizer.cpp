@@ -0,0 +1,151 @@
+#include "pool_sizer.hpp"
+
+#include "metrics.hpp"
+#include "topology.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+
+// Time the calling thread spent runnable but waiting for a CPU, the second
+// field of /proc/thread-self/schedstat. The file is opened once per thread,
+// since it resolves to the thread that opens it. 0 if unavailable.
+uint64_t runQueueWaitNs()
+{
+    struct SchedStat
+    {
+        int fd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+
+        ~SchedStat()
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+    };
+    thread_local const SchedStat schedStat;
+
+    char buffer[96];
+    const ssize_t size = schedStat.fd == -1 ? -1 : pread(schedStat.fd, buffer, sizeof(buffer), 0);
+    if (size <= 0)
+    {
+        return 0;
+    }
+    const char* end = buffer + size;
+    const char* field = std::find(static_cast<const char*>(buffer), end, ' ');
+    uint64_t waitNs = 0;
+    if (field == end || std::from_chars(field + 1, end, waitNs).ec != std::errc{})
+    {
+        return 0;
+    }
+    return waitNs;
+}
+
+} // namespace
+
+size_t runnableCoreCount()
+{
+    // Pool workers are confined to the worker cpulist when one is configured.
+    topology::CpuList workers = topology::affinityConfig().workers;
+    if (!workers.empty())
+    {
+        std::ranges::sort(workers);
+        return static_cast<size_t>(std::ranges::unique(workers).begin() - workers.begin());
+    }
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+PoolSizer::PoolSizer(PoolSizerOptions options, size_t initialThreads)
+    : mOptions(options), mSize(std::clamp(initialThreads, options.minThreads, options.maxThreads))
+{
+    metrics::io().poolSize.set(static_cast<int64_t>(mSize));
+}
+
+size_t PoolSizer::decide(const PoolSample& sample)
+{
+    const bool mostlyPreempted = sample.preemptedFraction > sample.blockedFraction;
+    const size_t growLimit =
+        mostlyPreempted ? std::min(mOptions.maxThreads, std::max(mOptions.runnableCores, mOptions.minThreads))
+                        : mOptions.maxThreads;
+    const bool wantsGrow = mSize < growLimit && sample.meanQueueWait > mOptions.growWait &&
+                           sample.blockedFraction >= mOptions.growBlockedFraction;
+    const bool wantsShrink = mSize > mOptions.minThreads && sample.meanQueueWait < mOptions.shrinkWait;
+
+    mGrowStreak = wantsGrow ? mGrowStreak + 1 : 0;
+    mShrinkStreak = wantsShrink ? mShrinkStreak + 1 : 0;
+
+    // Grow fast so a cold cache is absorbed within a few iterations, shrink
+    // one thread at a time so a short lull does not throw away the pool.
+    if (mGrowStreak >= mOptions.stableSamples)
+    {
+        mSize = std::min(mSize * 2, growLimit);
+        mGrowStreak = 0;
+        metrics::io().poolGrows.add();
+    }
+    else if (mShrinkStreak >= mOptions.stableSamples)
+    {
+        mSize -= 1;
+        mShrinkStreak = 0;
+        metrics::io().poolShrinks.add();
+    }
+    return mSize;
+}
+
+size_t PoolSizer::update()
+{
+    metrics::IoMetrics& io = metrics::io();
+    const metrics::Histogram::Snapshot wait = io.poolTaskWaitNs.snapshot();
+    const uint64_t busyNs = io.poolBusyNs.value();
+    const uint64_t blockedNs = io.poolBlockedNs.value();
+    const uint64_t preemptedNs = io.poolPreemptedNs.value();
+
+    PoolSample sample;
+    sample.tasks = wait.count - mLastWaitCount;
+    if (sample.tasks > 0)
+    {
+        sample.meanQueueWait = std::chrono::nanoseconds{(wait.sum - mLastWaitSum) / sample.tasks};
+    }
+    if (busyNs > mLastBusyNs)
+    {
+        const auto busy = static_cast<double>(busyNs - mLastBusyNs);
+        sample.blockedFraction = static_cast<double>(blockedNs - mLastBlockedNs) / busy;
+        sample.preemptedFraction = static_cast<double>(preemptedNs - mLastPreemptedNs) / busy;
+    }
+    mLastWaitCount = wait.count;
+    mLastWaitSum = wait.sum;
+    mLastBusyNs = busyNs;
+    mLastBlockedNs = blockedNs;
+    mLastPreemptedNs = preemptedNs;
+
+    io.poolMeanWaitNs.set(static_cast<int64_t>(sample.meanQueueWait.count()));
+    io.poolBlockedPermille.set(static_cast<int64_t>(sample.blockedFraction * 1000.0));
+    const size_t size = decide(sample);
+    io.poolSize.set(static_cast<int64_t>(size));
+    return size;
+}
+
+ScopedWorkTimer::ScopedWorkTimer() : mWallStart(std::chrono::steady_clock::now())
+{
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &mCpuStart);
+    mRunQueueStartNs = runQueueWaitNs();
+}
+
+ScopedWorkTimer::~ScopedWorkTimer()
+{
+    timespec cpuEnd;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    const auto wall = std::chrono::steady_clock::now() - mWallStart;
+    const auto cpu = std::chrono::seconds{cpuEnd.tv_sec - mCpuStart.tv_sec} +
+                     std::chrono::nanoseconds{cpuEnd.tv_nsec - mCpuStart.tv_nsec};
+    const auto preempted = std::chrono::nanoseconds{runQueueWaitNs() - mRunQueueStartNs};
+    const auto blocked = std::max(wall - cpu - preempted, decltype(wall - cpu - preempted){0});
+    metrics::io().poolBusyNs.add(static_cast<uint64_t>(std::chrono::nanoseconds{wall}.count()));
+    metrics::io().poolPreemptedNs.add(static_cast<uint64_t>(preempted.count()));
+    metrics::io().poolBlockedNs.add(static_cast<uint64_t>(std::chrono::nanoseconds{blocked}.count()));
+}
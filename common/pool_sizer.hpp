@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// CPUs pool workers may run on.
+size_t runnableCoreCount();
+
+// What the workers of a pool went through since the previous sample.
+struct PoolSample
+{
+    std::chrono::nanoseconds meanQueueWait{0};
+    // Fraction of the time spent running tasks that the worker was blocked,
+    // i.e. neither on CPU nor runnable and waiting for one.
+    double blockedFraction = 0.0;
+    // Fraction of that time the worker was runnable but waiting for a CPU.
+    // Adding threads cannot reduce it.
+    double preemptedFraction = 0.0;
+    uint64_t tasks = 0;
+};
+
+struct PoolSizerOptions
+{
+    size_t minThreads;
+    size_t maxThreads;
+    // Grow when tasks wait longer than this and workers are mostly blocked:
+    // more threads only help if the current ones are not using the CPU.
+    std::chrono::nanoseconds growWait{std::chrono::microseconds{200}};
+    double growBlockedFraction = 0.5;
+    // Shrink when tasks barely wait. The gap with the grow thresholds is the
+    // hysteresis that keeps the size from oscillating.
+    std::chrono::nanoseconds shrinkWait{std::chrono::microseconds{20}};
+    // Consecutive samples that must agree before acting.
+    size_t stableSamples = 2;
+    // The pool does not grow past this many threads while workers spend more
+    // time preempted than blocked: the extra threads would only queue for
+    // the same CPUs.
+    size_t runnableCores = runnableCoreCount();
+};
+
+// Decides the size of a thread pool from queue wait time and blocked time.
+// Fed from the pool metrics (see `metrics::IoMetrics`) once per iteration.
+class PoolSizer
+{
+public:
+    PoolSizer(PoolSizerOptions options, size_t initialThreads);
+
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    // Applies the policy to `sample`: advances the grow/shrink streaks, counts
+    // the resulting resize in the metrics and returns the new size.
+    size_t decide(const PoolSample& sample);
+
+    // Samples the pool metrics since the last call, decides and publishes the
+    // result to the metrics. Returns the new size.
+    size_t update();
+
+private:
+    PoolSizerOptions mOptions;
+    size_t mSize;
+    size_t mGrowStreak = 0;
+    size_t mShrinkStreak = 0;
+
+    uint64_t mLastWaitCount = 0;
+    uint64_t mLastWaitSum = 0;
+    uint64_t mLastBusyNs = 0;
+    uint64_t mLastBlockedNs = 0;
+    uint64_t mLastPreemptedNs = 0;
+};
+
+// Measures the wall time of a piece of work run on a pool worker and splits
+// the part spent off CPU into time runnable but waiting for a CPU (from
+// /proc/thread-self/schedstat) and time blocked. Adds them to the pool
+// busy/preempted/blocked metrics when it goes out of scope.
+class ScopedWorkTimer
+{
+public:
+    ScopedWorkTimer();
+    ~ScopedWorkTimer();
+
+    ScopedWorkTimer(const ScopedWorkTimer&) = delete;
+    ScopedWorkTimer& operator=(const ScopedWorkTimer&) = delete;
+
+private:
+    std::chrono::steady_clock::time_point mWallStart;
+    timespec mCpuStart;
+    uint64_t mRunQueueStartNs;
+};
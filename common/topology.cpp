@@ -0,0 +1,265 @@
+#include "topology.hpp"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <print>
+#include <string>
+#include <utility>
+
+namespace topology
+{
+
+namespace
+{
+
+std::optional<int> parseInt(std::string_view text)
+{
+    int value = 0;
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc{} || end != text.data() + text.size() || value < 0)
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::optional<CpuList> readCpuList(const fs::path& path)
+{
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line))
+    {
+        return std::nullopt;
+    }
+    return parseCpuList(line);
+}
+
+std::optional<CpuList> cpuListFromEnvironment(const char* name)
+{
+    const char* value = std::getenv(name);
+    if (value == nullptr)
+    {
+        return std::nullopt;
+    }
+    auto cpus = parseCpuList(value);
+    if (!cpus)
+    {
+        std::println("topology: ignoring invalid cpulist {}={}", name, value);
+    }
+    return cpus;
+}
+
+} // namespace
+
+std::optional<CpuList> parseCpuList(std::string_view text)
+{
+    while (!text.empty() && (text.back() == '\n' || text.back() == ' '))
+    {
+        text.remove_suffix(1);
+    }
+    CpuList cpus;
+    while (!text.empty())
+    {
+        const size_t comma = text.find(',');
+        const std::string_view range = text.substr(0, comma);
+        text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+
+        const size_t dash = range.find('-');
+        const auto first = parseInt(range.substr(0, dash));
+        const auto last = dash == std::string_view::npos ? first : parseInt(range.substr(dash + 1));
+        // cpu_set_t cannot hold more, and a typo such as 0-2000000000 must not
+        // expand into billions of entries.
+        if (!first || !last || *last < *first || *last >= CPU_SETSIZE)
+        {
+            return std::nullopt;
+        }
+        for (int cpu = *first; cpu <= *last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+int Topology::nodeOfCpu(int cpu) const
+{
+    for (const NumaNode& node: nodes)
+    {
+        if (std::ranges::find(node.cpus, cpu) != node.cpus.end())
+        {
+            return node.id;
+        }
+    }
+    return -1;
+}
+
+Topology detect()
+{
+    const char* root = std::getenv("TOPOLOGY_SYSFS_ROOT");
+    return detect(root != nullptr ? fs::path(root) : fs::path("/sys"));
+}
+
+Topology detect(const fs::path& sysfsRoot)
+{
+    Topology topology;
+    const fs::path nodeDir = sysfsRoot / "devices/system/node";
+    std::error_code ec;
+    for (const auto& entry: fs::directory_iterator(nodeDir, ec))
+    {
+        const std::string name = entry.path().filename().string();
+        if (!name.starts_with("node"))
+        {
+            continue;
+        }
+        const auto id = parseInt(std::string_view(name).substr(4));
+        const auto cpus = readCpuList(entry.path() / "cpulist");
+        if (id && cpus && !cpus->empty())
+        {
+            topology.nodes.push_back({*id, *cpus});
+        }
+    }
+    std::ranges::sort(topology.nodes, {}, &NumaNode::id);
+
+    if (topology.nodes.empty())
+    {
+        auto online = readCpuList(sysfsRoot / "devices/system/cpu/online");
+        topology.nodes.push_back({0, online.value_or(CpuList{0})});
+    }
+    return topology;
+}
+
+bool pinCurrentThread(const CpuList& cpus)
+{
+    if (cpus.empty())
+    {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus)
+    {
+        CPU_SET(static_cast<size_t>(cpu), &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+AffinityConfig affinityFromEnvironment(const Topology& topology)
+{
+    AffinityConfig config;
+    if (const char* nodeValue = std::getenv("AFFINITY_NODE"))
+    {
+        const auto id = parseInt(nodeValue);
+        for (const NumaNode& node: topology.nodes)
+        {
+            if (id && node.id == *id)
+            {
+                config.owner = config.workers = config.scheduler = node.cpus;
+            }
+        }
+    }
+    config.owner = cpuListFromEnvironment("AFFINITY_OWNER").value_or(config.owner);
+    config.workers = cpuListFromEnvironment("AFFINITY_WORKERS").value_or(config.workers);
+    config.scheduler = cpuListFromEnvironment("AFFINITY_SCHEDULER").value_or(config.scheduler);
+
+    if (!config.owner.empty())
+    {
+        const int node = topology.nodeOfCpu(config.owner.front());
+        const bool singleNode = std::ranges::all_of(config.owner,
+                                                    [&topology, node](int cpu)
+                                                    {
+                                                        return topology.nodeOfCpu(cpu) == node;
+                                                    });
+        config.memoryNode = singleNode ? node : -1;
+    }
+    return config;
+}
+
+const Topology& systemTopology()
+{
+    static const Topology topology = detect();
+    return topology;
+}
+
+const AffinityConfig& affinityConfig()
+{
+    static const AffinityConfig config = affinityFromEnvironment(systemTopology());
+    return config;
+}
+
+void pinWorker(size_t workerIndex)
+{
+    const CpuList& workers = affinityConfig().workers;
+    if (!workers.empty())
+    {
+        const int cpu = workers[workerIndex % workers.size()];
+        if (!pinCurrentThread({cpu}))
+        {
+            std::println("pinWorker: failed to pin worker {} to CPU {}", workerIndex, cpu);
+        }
+    }
+}
+
+NodeLocalBuffer::NodeLocalBuffer(size_t size, int node) : mSize(size)
+{
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    mData = static_cast<char*>(data);
+    if (node >= 0)
+    {
+        // MPOL_PREFERRED falls back to other nodes instead of failing when the
+        // preferred one runs out of memory.
+        const unsigned long nodeMask = static_cast<size_t>(node) < sizeof(unsigned long) * 8 ? 1ul << node : 0;
+        if (nodeMask == 0 ||
+            syscall(SYS_mbind, mData, size, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8, 0) != 0)
+        {
+            std::println("NodeLocalBuffer: failed to bind {} bytes to node {}, using first touch", size, node);
+        }
+    }
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t offset = 0; offset < size; offset += pageSize)
+    {
+        mData[offset] = 0;
+    }
+}
+
+NodeLocalBuffer::~NodeLocalBuffer()
+{
+    if (mData != nullptr)
+    {
+        munmap(mData, mSize);
+    }
+}
+
+NodeLocalBuffer::NodeLocalBuffer(NodeLocalBuffer&& other) noexcept
+    : mData(std::exchange(other.mData, nullptr)), mSize(std::exchange(other.mSize, 0))
+{
+}
+
+NodeLocalBuffer& NodeLocalBuffer::operator=(NodeLocalBuffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (mData != nullptr)
+        {
+            munmap(mData, mSize);
+        }
+        mData = std::exchange(other.mData, nullptr);
+        mSize = std::exchange(other.mSize, 0);
+    }
+    return *this;
+}
+
+} // namespace topology
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace topology
+{
+
+using CpuList = std::vector<int>;
+
+// Parses the kernel cpulist format, e.g. "0-3,8,10-11".
+std::optional<CpuList> parseCpuList(std::string_view text);
+
+struct NumaNode
+{
+    int id;
+    CpuList cpus;
+};
+
+struct Topology
+{
+    std::vector<NumaNode> nodes;
+
+    // Node owning `cpu`, or -1 if unknown.
+    int nodeOfCpu(int cpu) const;
+};
+
+// Reads the NUMA layout from /sys/devices/system/node. The sysfs root can be
+// overridden with TOPOLOGY_SYSFS_ROOT to emulate a multi-node host. Machines
+// without NUMA support are reported as a single node with every online CPU.
+Topology detect();
+Topology detect(const fs::path& sysfsRoot);
+
+// Restricts the calling thread to `cpus`. An empty list leaves it floating.
+bool pinCurrentThread(const CpuList& cpus);
+
+// Where each kind of thread should run. Empty lists mean no pinning. Pool
+// worker `i` is pinned to `workers[i % workers.size()]`.
+struct AffinityConfig
+{
+    CpuList owner;
+    CpuList workers;
+    CpuList scheduler;
+    // Node the owner's memory should be placed on, or -1 to rely on the
+    // kernel's first-touch policy.
+    int memoryNode = -1;
+};
+
+// Built from the environment:
+// - AFFINITY_NODE=<n> pins every thread to the CPUs of node n
+// - AFFINITY_OWNER, AFFINITY_WORKERS, AFFINITY_SCHEDULER take a cpulist and
+//   override the node default for that kind of thread
+AffinityConfig affinityFromEnvironment(const Topology& topology);
+
+// Process wide configuration, detected once on first use.
+const Topology& systemTopology();
+const AffinityConfig& affinityConfig();
+
+// Pins the calling pool worker according to `affinityConfig()`.
+void pinWorker(size_t workerIndex);
+
+// Anonymous memory bound to a preferred NUMA node. Pages are touched on
+// construction so they are placed before any other thread reads them.
+class NodeLocalBuffer
+{
+public:
+    NodeLocalBuffer(size_t size, int node);
+    ~NodeLocalBuffer();
+
+    NodeLocalBuffer(const NodeLocalBuffer&) = delete;
+    NodeLocalBuffer& operator=(const NodeLocalBuffer&) = delete;
+    NodeLocalBuffer(NodeLocalBuffer&& other) noexcept;
+    NodeLocalBuffer& operator=(NodeLocalBuffer&& other) noexcept;
+
+    std::span<char> span()
+    {
+        return {mData, mSize};
+    }
+
+    std::string_view view() const
+    {
+        return {mData, mSize};
+    }
+
+private:
+    char* mData = nullptr;
+    size_t mSize = 0;
+};
+
+} // namespace topology
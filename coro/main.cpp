@@ -20,31 +20,36 @@
 #include <variant>
 #include <vector>
 
+#include "common/append_log.hpp"
+#include "common/batch.hpp"
+#include "common/cancellation.hpp"
 #include "common/helpers.hpp"
+#include "common/metrics.hpp"
+#include "common/oplog.hpp"
+#include "common/pool_sizer.hpp"
+#include "common/topology.hpp"
 
 
-coro::task<size_t> countNumbersInFile(const fs::path& path,
-                                      coro::thread_pool& threadpool,
-                                      coro::io_scheduler& scheduler)
+// Kept out of the coroutine so the scan buffer lives on the stack of the pool
+// worker running it, i.e. on the worker's NUMA node, instead of in a frame
+// allocated by the owner thread. Returns std::nullopt if `token` is cancelled
+// before the scan completes.
+std::optional<size_t> countDigits(int fd, const CancellationToken& token)
 {
-    if (!fs::exists(path))
-    {
-        co_return 0;
-    }
-    // Open the file using linux api
-
-    const auto fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1)
+    ScopedWorkTimer timer;
+    if (token.cancelled())
     {
-        co_return 0;
+        return std::nullopt;
     }
-
-    co_await threadpool.schedule();
+    evictFromPageCacheIfCold(fd);
     size_t count = 0;
+    size_t totalRead = 0;
     char buffer[4096];
     ssize_t bytesRead;
-    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+    bool cancelled = false;
+    while (!(cancelled = token.cancelled()) && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
     {
+        totalRead += static_cast<size_t>(bytesRead);
         for (ssize_t i = 0; i < bytesRead; ++i)
         {
             if (buffer[i] >= '0' && buffer[i] <= '9')
@@ -53,173 +58,228 @@ coro::task<size_t> countNumbersInFile(const fs::path& path,
             }
         }
     }
-    co_await scheduler.schedule();
-    close(fd);
-    co_return count;
-}
-
-coro::task<bool> readFileHasValidNumberOfDigits(const fs::path& path,
-                                                coro::thread_pool& threadpool,
-                                                coro::io_scheduler& scheduler)
-{
-    co_await scheduler.schedule();
-    size_t count = co_await countNumbersInFile(path, threadpool, scheduler);
-    co_return count % 10 == 0;
+    metrics::io().bytesRead.add(totalRead);
+    if (cancelled)
+    {
+        return std::nullopt;
+    }
+    return count;
 }
 
-bool writeToFile(const fs::path& path,
-                 std::string_view data,
-                 std::optional<off_t> offset = std::nullopt)
+// Takes the token by value: it must outlive every suspension of the coroutine.
+coro::task<std::optional<size_t>> countNumbersInFile(const fs::path& path,
+                                                     coro::thread_pool& threadpool,
+                                                     coro::io_scheduler& scheduler,
+                                                     CancellationToken token)
 {
-    // Open the file using linux api
-    const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_APPEND), 0644);
-    if (fd == -1)
+    // Already cancelled: no file to open and no hops to pay for.
+    if (token.cancelled())
     {
-        std::println("write: open failed");
-        return false;
+        co_return std::nullopt;
     }
-    if (offset)
+    if (!fs::exists(path))
     {
-        if (::lseek(fd, *offset, SEEK_SET) == (off_t)-1)
-        {
-            ::close(fd);
-            std::println("write: lseek failed");
-            return false;
-        }
+        co_return 0;
     }
-    ssize_t bytesWritten = write(fd, data.data(), data.size());
-    if (bytesWritten == -1)
+    // Open the file using linux api
+
+    const auto fd = open(path.c_str(), O_RDONLY);
+    metrics::io().openCalls.add();
+    if (fd == -1)
     {
-        std::println("write: write failed");
-        close(fd);
-        return false;
+        co_return 0;
     }
+
+    metrics::io().opsInFlight.add(1);
+    metrics::io().threadPoolHops.add();
+    const auto handedOffAt = std::chrono::steady_clock::now();
+    co_await threadpool.schedule();
+    metrics::io().poolTaskWaitNs.record(std::chrono::steady_clock::now() - handedOffAt);
+    // countDigits checks the token before evicting or reading, so a scan
+    // cancelled while queued does no I/O. The hop back and the close happen regardless.
+    const std::optional<size_t> count = countDigits(fd, token);
+    metrics::io().opsInFlight.add(-1);
+    metrics::io().schedulerHops.add();
+    co_await scheduler.schedule();
     close(fd);
-    return bytesWritten == static_cast<ssize_t>(data.size());
+    metrics::io().closeCalls.add();
+    co_return count;
 }
 
-bool writeToFileInChunks(const fs::path& path, std::string_view data, size_t nChunks)
+coro::task<Outcome> readFileHasValidNumberOfDigits(const fs::path& path,
+                                                   coro::thread_pool& threadpool,
+                                                   coro::io_scheduler& scheduler,
+                                                   CancellationToken token)
 {
-    size_t totalSize = data.size();
-    size_t offset = 0;
-    size_t chunkSize = totalSize / nChunks;
-    while (offset < totalSize)
+    metrics::io().schedulerHops.add();
+    co_await scheduler.schedule();
+    std::optional<size_t> count = co_await countNumbersInFile(path, threadpool, scheduler, token);
+    if (!count)
     {
-        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
-        if (!writeToFile(path, data.substr(offset, currentChunkSize), offset))
-        {
-            std::println("writeToFileInChunks: writeToFile failed at offset {}", offset);
-            return false;
-        }
-        offset += currentChunkSize;
+        co_return Outcome::Cancelled;
     }
-    return true;
+    co_return outcomeOf(*count % 10 == 0);
 }
 
-coro::task<bool> processOperation(const Operation& op,
-                                  coro::thread_pool& threadpool,
-                                  coro::io_scheduler& scheduler)
+// Not a coroutine itself: hands back the read coroutine directly so no frame is
+// spent on forwarding its result.
+coro::task<Outcome> processOperation(const ReadOperation& readOp,
+                                     coro::thread_pool& threadpool,
+                                     coro::io_scheduler& scheduler,
+                                     const CancellationToken& token)
 {
-    co_return co_await std::visit(
-        overloaded{[&threadpool, &scheduler](const ReadOperation& readOp) -> coro::task<bool>
-                   {
-                       co_return co_await readFileHasValidNumberOfDigits(readOp.path, threadpool, scheduler);
-                   },
-                   [](const WriteOperation& writeOp) -> coro::task<bool>
-                   {
-                       co_return writeToFile(writeOp.path, writeOp.data);
-                   },
-                   [](const WriteInChunksOperation& writeOp) -> coro::task<bool>
-                   {
-                       co_return writeToFileInChunks(writeOp.path, writeOp.data, writeOp.chunkSize);
-                   }},
-        op);
+    return readFileHasValidNumberOfDigits(readOp.path, threadpool, scheduler, token);
 }
 
 class Component
 {
 public:
-    Component()
+    // A stop requested on `stopSource` has the same effect as `requestStop`.
+    Component(oplog::Session& session, std::stop_source stopSource)
+        : mSession(session), mStopSource(std::move(stopSource))
     {
-        mOperations.reserve(NUM_OPERATIONS);
-        for (size_t i = 0; i < NUM_OPERATIONS; ++i)
-        {
-            mOperations.push_back(createRandomOperation(mBuffer));
-        }
+        mSession.attachBuffer(mBuffer.view());
+        std::apply(
+            [](auto&... bucket)
+            {
+                (bucket.reserve(NUM_OPERATIONS), ...);
+            },
+            mOperations);
+        refillOperationsIfNeeded();
     }
 
     void eventLoop(size_t iterations)
     {
-        for (size_t i = 0; i < iterations; ++i)
+        for (size_t i = 0; i < iterations && !mStopSource.stop_requested() && mSession.beginIteration(mOperations);
+             ++i)
         {
-            runIteration();
+            runIteration(i);
+            mSession.endIteration();
             refillOperationsIfNeeded();
+            resizeThreadPoolIfNeeded();
+            mMetricsDumper.tick();
         }
+        // Closed before the final dump so it counts every close.
+        mAppendLog.close();
+        mMetricsDumper.dump();
+    }
+
+    // Can be called from any thread. Operations in flight are cancelled and the
+    // event loop returns after the current iteration.
+    void requestStop()
+    {
+        mStopSource.request_stop();
     }
 
     void refillOperationsIfNeeded()
     {
-        while (mOperations.size() < NUM_OPERATIONS)
+        for (size_t i = operationCount(mOperations); i < NUM_OPERATIONS; ++i)
         {
-            mOperations.push_back(createRandomOperation(mBuffer));
+            addOperation(mOperations, createRandomOperation(mBuffer.view()));
         }
     }
 
-    void runIteration()
+    void runIteration(size_t iteration)
     {
-        std::vector<coro::task<bool>> tasks;
-        for (auto& op: mOperations)
+        const CancellationToken token = iterationToken(mStopSource, mIterationBudget);
+        auto& reads = std::get<std::vector<ReadOperation>>(mOperations);
+        std::vector<coro::task<Outcome>> tasks;
+        tasks.reserve(reads.size() + 1);
+        for (const ReadOperation& readOp: reads)
         {
-            tasks.push_back(processOperation(op, *mThreadPool, *scheduler));
+            tasks.push_back(processOperation(readOp, *mThreadPool, *scheduler, token));
         }
+        // when_all starts its tasks in order on this thread, so by the time the
+        // writes run every read has already hopped to the scheduler.
+        tasks.push_back(processWriteBatches(iteration, token));
         auto results = coro::sync_wait(coro::when_all(std::move(tasks)));
-        std::unordered_set<size_t> indicesToRemove;
-        for (size_t i = 0; i < results.size(); ++i)
+
+        std::vector<Outcome> outcomes(reads.size());
+        for (size_t i = 0; i < reads.size(); ++i)
         {
-            if (results[i].return_value())
-            {
-                indicesToRemove.insert(i);
-            }
+            outcomes[i] = results[i].return_value();
         }
-        size_t i = 0;
-        mOperations.erase(std::remove_if(mOperations.begin(),
-                                         mOperations.end(),
-                                         [&indicesToRemove, &i](const Operation&)
-                                         {
-                                             return indicesToRemove.find(i++) !=
-                                                    indicesToRemove.end();
-                                         }),
-                          mOperations.end());
+        completeBatch(mSession, reads, outcomes);
     }
 
 private:
-    std::vector<Operation> mOperations;
-    const std::string mBuffer = generateRandomString(5 * 1024 * 1024);
-    std::shared_ptr<coro::thread_pool> mThreadPool{
-        coro::thread_pool::make_shared(coro::thread_pool::options{.thread_count = NUM_THREADS})};
+    // libcoro's thread_pool has a fixed size, so a resize swaps in a new pool.
+    // Only done between iterations, when no task is scheduled on the old one.
+    void resizeThreadPoolIfNeeded()
+    {
+        const size_t previous = mPoolSizer.size();
+        const size_t size = mPoolSizer.update();
+        if (size != previous)
+        {
+            mThreadPool = makeThreadPool(size);
+        }
+    }
+
+    static std::shared_ptr<coro::thread_pool> makeThreadPool(size_t numThreads)
+    {
+        return coro::thread_pool::make_shared(coro::thread_pool::options{
+            .thread_count = static_cast<uint32_t>(numThreads),
+            .on_thread_start_functor = topology::pinWorker,
+        });
+    }
+
+    // A single frame for all the writes of the iteration. Its result is unused.
+    coro::task<Outcome> processWriteBatches(size_t iteration, CancellationToken token)
+    {
+        processWriteBuckets(mOperations, iteration, mSession, mAppendLog, token);
+        co_return Outcome::Kept;
+    }
+
+    oplog::Session& mSession;
+    std::stop_source mStopSource;
+    const std::optional<std::chrono::milliseconds> mIterationBudget = iterationBudgetFromEnvironment();
+    OperationBuckets mOperations;
+    AppendLog mAppendLog;
+    const topology::NodeLocalBuffer mBuffer =
+        generateRandomBuffer(5 * 1024 * 1024, topology::affinityConfig().memoryNode);
+    PoolSizer mPoolSizer{{.minThreads = MIN_THREADS, .maxThreads = MAX_THREADS}, NUM_THREADS};
+    std::shared_ptr<coro::thread_pool> mThreadPool{makeThreadPool(mPoolSizer.size())};
     std::shared_ptr<coro::io_scheduler> scheduler{
         coro::io_scheduler::make_shared(coro::io_scheduler::options{
             .thread_strategy = coro::io_scheduler::thread_strategy_t::spawn,
+            .on_io_thread_start_functor =
+                []()
+                {
+                    if (!topology::pinCurrentThread(topology::affinityConfig().scheduler))
+                    {
+                        std::println("scheduler: failed to pin the io thread");
+                    }
+                },
             .execution_strategy = coro::io_scheduler::execution_strategy_t::process_tasks_inline})};
+    metrics::PeriodicDumper mMetricsDumper{"metrics_coro.prom", metrics::DUMP_INTERVAL};
 };
 
 int main()
 {
-    Component component{};
+    // Before any thread exists, so none of them gets SIGINT or SIGTERM.
+    ShutdownSignals shutdownSignals;
+    if (!topology::pinCurrentThread(topology::affinityConfig().owner))
+    {
+        std::println("main: failed to pin the owner thread");
+    }
+    oplog::Session session = oplog::Session::fromEnvironment();
+    srand(static_cast<unsigned>(session.seed()));
+    // Every run starts from the same files so replays see the same contents.
+    removeDataFiles();
+    Component component{session, shutdownSignals.stopSource()};
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     component.eventLoop(NUM_ITERATIONS);
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     std::println("Coro - Execution time: {} ms", duration);
 
-    // remove files
-    for (size_t i = 0; i < MAX_FILE_INDEX; ++i)
+    if (session.replaying())
     {
-        fs::path path = fs::path("file_" + std::to_string(i) + ".txt");
-        if (fs::exists(path))
-        {
-            fs::remove(path);
-        }
+        std::println("{} - Replay: {} outcomes differ from the log", "Coro", session.mismatches());
     }
-    return 0;
+
+    removeDataFiles();
+    // A replay that diverged from its log, or a log that could not be written
+    // or read in full, fails the run.
+    return session.mismatches() == 0 && !session.logFailed() ? 0 : 1;
 }
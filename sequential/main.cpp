@@ -11,10 +11,17 @@
 #include <variant>
 #include <vector>
 
+#include "common/append_log.hpp"
+#include "common/batch.hpp"
+#include "common/cancellation.hpp"
 #include "common/helpers.hpp"
+#include "common/metrics.hpp"
+#include "common/oplog.hpp"
+#include "common/topology.hpp"
 
 
-size_t countNumbersInFile(const fs::path& path)
+// Returns std::nullopt if `token` is cancelled before the scan completes.
+std::optional<size_t> countNumbersInFile(const fs::path& path, const CancellationToken& token)
 {
     if (!fs::exists(path))
     {
@@ -23,16 +30,24 @@ size_t countNumbersInFile(const fs::path& path)
     // Open the file using linux api
 
     const auto fd = open(path.c_str(), O_RDONLY);
+    metrics::io().openCalls.add();
     if (fd == -1)
     {
         std::println("countNumbersInFile: open failed for file {}", path.string());
         return 0;
     }
+    if (!token.cancelled())
+    {
+        evictFromPageCacheIfCold(fd);
+    }
     size_t count = 0;
+    size_t totalRead = 0;
     char buffer[4096];
     ssize_t bytesRead;
-    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+    bool cancelled = false;
+    while (!(cancelled = token.cancelled()) && (bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
     {
+        totalRead += static_cast<size_t>(bytesRead);
         for (ssize_t i = 0; i < bytesRead; ++i)
         {
             if (buffer[i] >= '0' && buffer[i] <= '9')
@@ -42,149 +57,133 @@ size_t countNumbersInFile(const fs::path& path)
         }
     }
     close(fd);
-    return count;
-}
-
-bool readFileHasValidNumberOfDigits(const fs::path& path)
-{
-    size_t count = countNumbersInFile(path);
-    return count % 10 == 0;
-}
-
-bool writeToFile(const fs::path& path,
-                 std::string_view data,
-                 std::optional<off_t> offset = std::nullopt)
-{
-    // Open the file using linux api
-    const auto fd = open(path.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_APPEND), 0644);
-    if (fd == -1)
-    {
-        std::println("write: open failed");
-        return false;
-    }
-    if (offset)
+    metrics::io().closeCalls.add();
+    metrics::io().bytesRead.add(totalRead);
+    if (cancelled)
     {
-        if (::lseek(fd, *offset, SEEK_SET) == (off_t)-1)
-        {
-            ::close(fd);
-            std::println("write: lseek failed");
-            return false;
-        }
+        return std::nullopt;
     }
-    ssize_t bytesWritten = write(fd, data.data(), data.size());
-    if (bytesWritten == -1)
-    {
-        std::println("write: write failed");
-        close(fd);
-        return false;
-    }
-    close(fd);
-    return bytesWritten == static_cast<ssize_t>(data.size());
+    return count;
 }
 
-bool writeToFileInChunks(const fs::path& path, std::string_view data, size_t nChunks)
+Outcome readFileHasValidNumberOfDigits(const fs::path& path, const CancellationToken& token)
 {
-    size_t totalSize = data.size();
-    size_t offset = 0;
-    size_t chunkSize = totalSize / nChunks;
-    while (offset < totalSize)
+    std::optional<size_t> count = countNumbersInFile(path, token);
+    if (!count)
     {
-        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
-        if (!writeToFile(path, data.substr(offset, currentChunkSize), offset))
-        {
-            std::println("writeToFileInChunks: writeToFile failed at offset {}", offset);
-            return false;
-        }
-        offset += currentChunkSize;
+        return Outcome::Cancelled;
     }
-    return true;
+    return outcomeOf(*count % 10 == 0);
 }
 
-bool processOperation(const Operation& op)
+Outcome processOperation(const ReadOperation& readOp, const CancellationToken& token)
 {
-    return std::visit(
-        overloaded{[](const ReadOperation& readOp) -> bool
-                   {
-                       return readFileHasValidNumberOfDigits(readOp.path);
-                   },
-                   [](const WriteOperation& writeOp) -> bool
-                   {
-                       return writeToFile(writeOp.path, writeOp.data);
-                   },
-                   [](const WriteInChunksOperation& writeOp) -> bool
-                   {
-                       return writeToFileInChunks(writeOp.path, writeOp.data, writeOp.chunkSize);
-                   }},
-        op);
+    return readFileHasValidNumberOfDigits(readOp.path, token);
 }
 
 class Component
 {
 public:
-    Component()
+    // A stop requested on `stopSource` has the same effect as `requestStop`.
+    Component(oplog::Session& session, std::stop_source stopSource)
+        : mSession(session), mStopSource(std::move(stopSource))
     {
-        mOperations.reserve(NUM_OPERATIONS);
-        for (size_t i = 0; i < NUM_OPERATIONS; ++i)
-        {
-            mOperations.push_back(createRandomOperation(mBuffer));
-        }
+        mSession.attachBuffer(mBuffer.view());
+        std::apply(
+            [](auto&... bucket)
+            {
+                (bucket.reserve(NUM_OPERATIONS), ...);
+            },
+            mOperations);
+        refillOperationsIfNeeded();
     }
 
     void eventLoop(size_t iterations)
     {
-        for (size_t i = 0; i < iterations; ++i)
+        for (size_t i = 0; i < iterations && !mStopSource.stop_requested() && mSession.beginIteration(mOperations);
+             ++i)
         {
-            runIteration();
+            runIteration(i);
+            mSession.endIteration();
             refillOperationsIfNeeded();
+            mMetricsDumper.tick();
         }
+        // Closed before the final dump so it counts every close.
+        mAppendLog.close();
+        mMetricsDumper.dump();
+    }
+
+    // Can be called from any thread. Operations in flight are cancelled and the
+    // event loop returns after the current iteration.
+    void requestStop()
+    {
+        mStopSource.request_stop();
     }
 
     void refillOperationsIfNeeded()
     {
-        while (mOperations.size() < NUM_OPERATIONS)
+        for (size_t i = operationCount(mOperations); i < NUM_OPERATIONS; ++i)
         {
-            mOperations.push_back(createRandomOperation(mBuffer));
+            addOperation(mOperations, createRandomOperation(mBuffer.view()));
         }
     }
 
-    void runIteration()
+    void runIteration(size_t iteration)
     {
-        for (auto it = mOperations.begin(); it != mOperations.end();)
-        {
-            bool remove = processOperation(*it);
-            if (remove)
-            {
-                it = mOperations.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
-        }
+        const CancellationToken token = iterationToken(mStopSource, mIterationBudget);
+        forEachBucketFrom(mOperations,
+                          iteration,
+                          [this, &token](auto& bucket)
+                          {
+                              using Op = typename std::decay_t<decltype(bucket)>::value_type;
+                              if constexpr (std::is_same_v<Op, ReadOperation>)
+                              {
+                                  completeBatch(mSession, bucket, processBatch(bucket, token));
+                              }
+                              else
+                              {
+                                  completeBatch(mSession, bucket, processBatch(bucket, token, mAppendLog));
+                              }
+                          });
     }
 
 private:
-    std::vector<Operation> mOperations;
-    const std::string mBuffer = generateRandomString(5 * 1024 * 1024);
+    oplog::Session& mSession;
+    std::stop_source mStopSource;
+    const std::optional<std::chrono::milliseconds> mIterationBudget = iterationBudgetFromEnvironment();
+    OperationBuckets mOperations;
+    AppendLog mAppendLog;
+    const topology::NodeLocalBuffer mBuffer =
+        generateRandomBuffer(5 * 1024 * 1024, topology::affinityConfig().memoryNode);
+    metrics::PeriodicDumper mMetricsDumper{"metrics_sequential.prom", metrics::DUMP_INTERVAL};
 };
 
 int main()
 {
-    Component component{};
+    // Before any thread exists, so none of them gets SIGINT or SIGTERM.
+    ShutdownSignals shutdownSignals;
+    if (!topology::pinCurrentThread(topology::affinityConfig().owner))
+    {
+        std::println("main: failed to pin the owner thread");
+    }
+    oplog::Session session = oplog::Session::fromEnvironment();
+    srand(static_cast<unsigned>(session.seed()));
+    // Every run starts from the same files so replays see the same contents.
+    removeDataFiles();
+    Component component{session, shutdownSignals.stopSource()};
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     component.eventLoop(NUM_ITERATIONS);
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
     std::println("Sequential - Execution time: {} ms", duration);
 
-    // remove files
-    for (size_t i = 0; i < MAX_FILE_INDEX; ++i)
+    if (session.replaying())
     {
-        fs::path path = fs::path("file_" + std::to_string(i) + ".txt");
-        if (fs::exists(path))
-        {
-            fs::remove(path);
-        }
+        std::println("{} - Replay: {} outcomes differ from the log", "Sequential", session.mismatches());
     }
-    return 0;
+
+    removeDataFiles();
+    // A replay that diverged from its log, or a log that could not be written
+    // or read in full, fails the run.
+    return session.mismatches() == 0 && !session.logFailed() ? 0 : 1;
 }